@@ -0,0 +1,112 @@
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class members for the block device
+
+**************************************************************** */
+
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "block_device.h"
+
+constexpr uint64_t block_device::base;
+constexpr uint64_t block_device::size;
+
+// Constructor
+block_device::block_device(memory *main_memory, interrupt_line interrupt,
+                           std::string file_name)
+    : main_memory(main_memory), interrupt(interrupt), disk(nullptr),
+      disk_bytes(0), sector(0), address(0), count(0), status(0) {
+  if (file_name.empty())
+    return;
+  int fd = open(file_name.c_str(), O_RDWR);
+  struct stat file_status;
+  if (fd < 0 || fstat(fd, &file_status) != 0) {
+    std::cout << "Failed to open disk file" << std::endl;
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+  this->disk_bytes = file_status.st_size - file_status.st_size % sector_size;
+  if (this->disk_bytes > 0) {
+    void *mapping = mmap(nullptr, this->disk_bytes, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+      std::cout << "Failed to map disk file" << std::endl;
+    else
+      this->disk = static_cast<uint8_t *>(mapping);
+  }
+  // The mapping remains valid after the file is closed
+  close(fd);
+}
+
+block_device::~block_device() {
+  if (this->disk)
+    munmap(this->disk, this->disk_bytes);
+}
+
+uint64_t block_device::read_doubleword(uint64_t offset, uint64_t mask,
+                                       uint64_t now) {
+  switch (offset) {
+  case capacity_register:
+    return this->disk_bytes / sector_size;
+  case sector_register:
+    return this->sector;
+  case address_register:
+    return this->address;
+  case count_register:
+    return this->count;
+  case status_register:
+    return this->status;
+  default:
+    return 0;
+  }
+}
+
+void block_device::write_doubleword(uint64_t offset, uint64_t data,
+                                    uint64_t mask, uint64_t now) {
+  switch (offset) {
+  case sector_register:
+    this->sector = (this->sector & ~mask) | (data & mask);
+    break;
+  case address_register:
+    this->address = (this->address & ~mask) | (data & mask);
+    break;
+  case count_register:
+    this->count = (this->count & ~mask) | (data & mask);
+    break;
+  case command_register:
+    transfer(data & mask);
+    break;
+  case status_register:
+    this->status &= ~(data & mask);
+    if (!(this->status & status_done))
+      this->interrupt(false);
+    break;
+  }
+}
+
+// Transfers complete immediately, so the interrupt is taken before the next
+// instruction if enabled
+void block_device::transfer(uint64_t command) {
+  uint64_t capacity = this->disk_bytes / sector_size;
+  bool in_range =
+      this->sector <= capacity && this->count <= capacity - this->sector;
+  if (!in_range || (command != command_read && command != command_write)) {
+    this->status |= status_error;
+  } else {
+    uint8_t *data = this->disk + this->sector * sector_size;
+    uint64_t bytes = this->count * sector_size;
+    if (command == command_read)
+      this->main_memory->write_block(this->address, data, bytes);
+    else
+      this->main_memory->read_block(this->address, data, bytes);
+  }
+  this->status |= status_done;
+  this->interrupt(true);
+}
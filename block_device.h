@@ -0,0 +1,79 @@
+#ifndef BLOCK_DEVICE_H
+#define BLOCK_DEVICE_H
+
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class for a DMA block device backed by a host file
+
+**************************************************************** */
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "device.h"
+#include "memory.h"
+
+// The guest sets up a transfer of whole sectors between the disk and memory,
+// then writes a command. The transfer is a direct copy between the mmap'd file
+// and memory pages, and completion raises the interrupt line until the guest
+// acknowledges it through the status register.
+class block_device : public device {
+
+public:
+  // Drives an interrupt line high (true) or low (false)
+  typedef std::function<void(bool level)> interrupt_line;
+
+  static constexpr uint64_t base = 0x0000000010001000ULL;
+  static constexpr uint64_t size = 0x0000000000000030ULL;
+  static constexpr uint64_t sector_size = 512;
+
+  // Register offsets from base
+  static constexpr uint64_t capacity_register = 0x00; // In sectors, read-only
+  static constexpr uint64_t sector_register = 0x08;
+  static constexpr uint64_t address_register = 0x10;
+  static constexpr uint64_t count_register = 0x18;
+  static constexpr uint64_t command_register = 0x20;
+  static constexpr uint64_t status_register = 0x28;
+
+  // Commands
+  static constexpr uint64_t command_read = 1;  // Disk to memory
+  static constexpr uint64_t command_write = 2; // Memory to disk
+
+  // Status bits, cleared by writing 1s
+  static constexpr uint64_t status_done = 0x1;
+  static constexpr uint64_t status_error = 0x2;
+
+  // Constructor. Maps the file, which is left unchanged in size. An empty
+  // file_name leaves the device without a disk.
+  block_device(memory *main_memory, interrupt_line interrupt,
+               std::string file_name);
+  ~block_device();
+
+  // Returns true if the backing file was mapped
+  bool is_open() { return this->disk != nullptr; }
+
+  uint64_t read_doubleword(uint64_t offset, uint64_t mask,
+                           uint64_t now) override;
+  void write_doubleword(uint64_t offset, uint64_t data, uint64_t mask,
+                        uint64_t now) override;
+
+private:
+  // We do not have ownership over this object! Do not free it!
+  memory *main_memory;
+  interrupt_line interrupt;
+
+  uint8_t *disk;
+  uint64_t disk_bytes;
+
+  uint64_t sector;
+  uint64_t address;
+  uint64_t count;
+  uint64_t status;
+
+  void transfer(uint64_t command);
+};
+
+#endif
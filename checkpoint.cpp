@@ -0,0 +1,93 @@
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class members for periodic incremental checkpoints
+
+**************************************************************** */
+
+#include <iostream>
+#include <random>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "processor.h"
+
+// Constructor
+checkpointer::checkpointer(memory *main_memory, processor *cpu,
+                           scheduler *events, std::string file_name,
+                           uint64_t interval)
+    : main_memory(main_memory), cpu(cpu), events(events),
+      file_name(file_name), interval(interval), chain(0), sequence(0),
+      generation(0), write_failed(false) {
+  this->generation = this->main_memory->track_dirty_pages();
+  this->events->schedule(this->cpu->get_ticks() + this->interval,
+                         [this](uint64_t time) { checkpoint(time); });
+}
+
+checkpointer::~checkpointer() { wait_for_writer(); }
+
+// The next checkpoint is scheduled from the current tick count rather than
+// this one's time, which differ if a snapshot has been restored since
+void checkpointer::checkpoint(uint64_t time) {
+  std::vector<uint64_t> state;
+  this->cpu->save_state(state);
+  wait_for_writer();
+  std::vector<uint64_t> keys;
+  std::vector<uint8_t> contents;
+  if (this->sequence == 0 ||
+      this->main_memory->replaced_since(this->generation)) {
+    save_base(state);
+  } else {
+    this->main_memory->dirty_pages(this->generation, keys);
+    this->main_memory->copy_pages(keys, contents);
+    this->generation = this->main_memory->start_dirty_generation();
+    std::string name = this->file_name + "." + std::to_string(this->sequence);
+    uint64_t chain = this->chain;
+    uint64_t sequence = this->sequence++;
+    // The copies are moved into the thread, which owns them until it ends
+    this->writer = std::thread(
+        [this, name, chain, sequence](const std::vector<uint64_t> &state,
+                                      const std::vector<uint64_t> &keys,
+                                      const std::vector<uint8_t> &contents) {
+          if (!memory::write_snapshot(name, chain, sequence, state, keys,
+                                      contents))
+            this->write_failed = true;
+        },
+        std::move(state), std::move(keys), std::move(contents));
+  }
+  this->events->schedule(this->cpu->get_ticks() + this->interval,
+                         [this](uint64_t time) { checkpoint(time); });
+}
+
+// A base starts a new chain, so that checkpoints left from an earlier chain
+// under the same name are never applied to it. They are removed once the base
+// has been written.
+void checkpointer::save_base(const std::vector<uint64_t> &state) {
+  std::random_device random;
+  uint64_t chain = (static_cast<uint64_t>(random()) << 32 | random()) | 1;
+  bool saved = this->main_memory->save_snapshot(this->file_name, state, chain);
+  this->generation = this->main_memory->start_dirty_generation();
+  if (!saved) {
+    std::cout << "Failed to write checkpoint" << std::endl;
+    this->sequence = 0;
+    return;
+  }
+  this->chain = chain;
+  this->sequence = 1;
+  for (uint64_t stale = 1;
+       unlink((this->file_name + "." + std::to_string(stale)).c_str()) == 0;
+       stale++) {
+  }
+}
+
+// A failed checkpoint breaks the chain, so the next one is a new base
+void checkpointer::wait_for_writer() {
+  if (this->writer.joinable())
+    this->writer.join();
+  if (this->write_failed) {
+    std::cout << "Failed to write checkpoint" << std::endl;
+    this->write_failed = false;
+    this->sequence = 0;
+  }
+}
@@ -0,0 +1,60 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class for periodic incremental checkpoints
+
+**************************************************************** */
+
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "memory.h"
+#include "scheduler.h"
+
+class processor;
+
+// Saves the machine to a snapshot file at a fixed interval of ticks, one per
+// retired instruction. The first checkpoint is a full snapshot, which is the
+// base of a chain, and each later one holds only the pages written since the
+// one before. Dirty pages are copied at the checkpoint and written out on a
+// background thread, while execution continues. Restoring the base snapshot
+// applies the whole chain.
+class checkpointer {
+
+public:
+  // Constructor
+  checkpointer(memory *main_memory, processor *cpu, scheduler *events,
+               std::string file_name, uint64_t interval);
+  ~checkpointer();
+
+private:
+  // We do not have ownership over these objects! Do not free them!
+  memory *main_memory;
+  processor *cpu;
+  scheduler *events;
+
+  std::string file_name;
+  uint64_t interval;
+  // Chain of the base snapshot, and the sequence number of the next
+  // checkpoint, or 0 if a new base is needed
+  uint64_t chain;
+  uint64_t sequence;
+  // Dirty page generation since the last checkpoint
+  uint64_t generation;
+
+  // Writer of the last incremental checkpoint, and whether it failed
+  std::thread writer;
+  bool write_failed;
+
+  void checkpoint(uint64_t time);
+  void save_base(const std::vector<uint64_t> &state);
+  void wait_for_writer();
+};
+
+#endif
@@ -0,0 +1,80 @@
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class members for the core local interruptor
+
+**************************************************************** */
+
+#include "clint.h"
+#include "processor.h"
+
+constexpr uint64_t clint::base;
+constexpr uint64_t clint::size;
+
+// mip bits driven by the CLINT
+static constexpr unsigned int msip_bit = 3;
+static constexpr unsigned int mtip_bit = 7;
+
+// Constructor
+clint::clint(processor *cpu, scheduler *events)
+    : cpu(cpu), events(events), mtime_offset(0), mtimecmp(~0ULL),
+      timer_scheduled(false), timer_event(0) {}
+
+uint64_t clint::mtime(uint64_t now) { return now + this->mtime_offset; }
+
+uint64_t clint::read_doubleword(uint64_t offset, uint64_t mask,
+                               uint64_t now) {
+  switch (offset & ~0x7ULL) {
+  case msip_register:
+    return this->cpu->get_interrupt_pending(msip_bit) ? 1 : 0;
+  case mtimecmp_register:
+    return this->mtimecmp;
+  case mtime_register:
+    return mtime(now);
+  default:
+    return 0;
+  }
+}
+
+void clint::write_doubleword(uint64_t offset, uint64_t data, uint64_t mask,
+                             uint64_t now) {
+  uint64_t value;
+  switch (offset & ~0x7ULL) {
+  case msip_register:
+    // Only bit 0 of the 32-bit msip register is implemented
+    if (mask & 0xff)
+      this->cpu->set_interrupt_pending(msip_bit, data & 1);
+    break;
+  case mtimecmp_register:
+    this->mtimecmp = (this->mtimecmp & ~mask) | (data & mask);
+    update_timer(now);
+    break;
+  case mtime_register:
+    value = (mtime(now) & ~mask) | (data & mask);
+    this->mtime_offset = value - now;
+    update_timer(now);
+    break;
+  }
+}
+
+void clint::update_timer(uint64_t now) {
+  if (this->timer_scheduled) {
+    this->events->cancel(this->timer_event);
+    this->timer_scheduled = false;
+  }
+  uint64_t current = mtime(now);
+  if (current >= this->mtimecmp) {
+    this->cpu->set_interrupt_pending(mtip_bit, true);
+    return;
+  }
+  this->cpu->set_interrupt_pending(mtip_bit, false);
+  uint64_t remaining = this->mtimecmp - current;
+  if (remaining > scheduler::never - now)
+    return; // Never reached
+  this->timer_scheduled = true;
+  this->timer_event = this->events->schedule(now + remaining, [this](uint64_t) {
+    this->timer_scheduled = false;
+    this->cpu->set_interrupt_pending(mtip_bit, true);
+  });
+}
@@ -0,0 +1,60 @@
+#ifndef CLINT_H
+#define CLINT_H
+
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class for the core local interruptor (machine timer and software
+   interrupts)
+
+**************************************************************** */
+
+#include <cstdint>
+
+#include "device.h"
+#include "scheduler.h"
+
+class processor;
+
+class clint : public device {
+
+private:
+  // We do not have ownership over these objects! Do not free them!
+  processor *cpu;
+  scheduler *events;
+
+  // mtime is the tick count plus an offset, so it never needs updating
+  uint64_t mtime_offset;
+  uint64_t mtimecmp;
+  bool timer_scheduled;
+  uint64_t timer_event;
+
+  // Update mip.MTIP, and schedule an event for when mtime reaches mtimecmp
+  void update_timer(uint64_t now);
+
+public:
+  // Register layout of the SiFive CLINT
+  static constexpr uint64_t base = 0x0000000002000000ULL;
+  static constexpr uint64_t size = 0x0000000000010000ULL;
+  static constexpr uint64_t msip_register = 0x0000;
+  static constexpr uint64_t mtimecmp_register = 0x4000;
+  static constexpr uint64_t mtime_register = 0xbff8;
+
+  // Constructor
+  clint(processor *cpu, scheduler *events);
+
+  // Current value of mtime at tick count now
+  uint64_t mtime(uint64_t now);
+
+  // Read a doubleword of registers at a doubleword-aligned offset from base
+  uint64_t read_doubleword(uint64_t offset, uint64_t mask,
+                           uint64_t now) override;
+
+  // Write a doubleword of registers at a doubleword-aligned offset from base.
+  // The mask contains 1s for bytes to be updated.
+  void write_doubleword(uint64_t offset, uint64_t data, uint64_t mask,
+                        uint64_t now) override;
+};
+
+#endif
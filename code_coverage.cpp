@@ -0,0 +1,151 @@
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class members for execution coverage
+
+**************************************************************** */
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include "code_coverage.h"
+
+// Raw bitmaps start with the magic number, the page size in bits and the
+// number of pages. Each page follows as its page number and its bitmaps.
+static constexpr uint64_t coverage_magic = 0x31564f4356520a00ULL;
+
+constexpr unsigned int code_coverage::page_bits;
+constexpr unsigned int code_coverage::slot_bits;
+
+// Constructor
+code_coverage::code_coverage() : last_key(0), last_page(nullptr) {}
+
+bool code_coverage::save(std::string file_name) {
+  std::vector<uint64_t> keys;
+  for (const auto &entry : this->pages)
+    keys.push_back(entry.first);
+  std::sort(keys.begin(), keys.end());
+  std::ofstream output_file(file_name, std::ios::binary);
+  uint64_t header[3] = {coverage_magic, page_bits, keys.size()};
+  output_file.write(reinterpret_cast<const char *>(header), sizeof(header));
+  for (uint64_t key : keys) {
+    const page &code = this->pages.at(key);
+    output_file.write(reinterpret_cast<const char *>(&key), sizeof(key));
+    output_file.write(reinterpret_cast<const char *>(&code), sizeof(code));
+  }
+  return output_file.good();
+}
+
+bool code_coverage::merge(std::string file_name) {
+  std::ifstream input_file(file_name, std::ios::binary);
+  uint64_t header[3];
+  if (!input_file.read(reinterpret_cast<char *>(header), sizeof(header)) ||
+      header[0] != coverage_magic || header[1] != page_bits)
+    return false;
+  for (uint64_t i = 0; i < header[2]; i++) {
+    uint64_t key;
+    page code;
+    if (!input_file.read(reinterpret_cast<char *>(&key), sizeof(key)) ||
+        !input_file.read(reinterpret_cast<char *>(&code), sizeof(code)))
+      return false;
+    page &ours = this->pages[key];
+    for (size_t word = 0; word < ours.executed.size(); word++) {
+      ours.executed[word] |= code.executed[word];
+      ours.taken[word] |= code.taken[word];
+      ours.not_taken[word] |= code.not_taken[word];
+    }
+  }
+  return true;
+}
+
+// Lines are every instruction of the functions, and any other instruction
+// which has executed
+bool code_coverage::write_lcov(std::string file_name, std::string source_name,
+                               const symbol_table &symbols,
+                               memory *main_memory) {
+  std::vector<symbol_table::function> functions;
+  symbols.functions(functions);
+  std::vector<uint64_t> lines;
+  for (const symbol_table::function &function : functions) {
+    for (uint64_t address = (function.address + 3) & ~3ULL;
+         address < function.address + function.size; address += 4)
+      lines.push_back(address);
+  }
+  for (const auto &entry : this->pages) {
+    for (uint64_t slot = 0; slot < (1 << slot_bits); slot++) {
+      uint64_t address = (entry.first << page_bits) | (slot << 2);
+      if (get_bit(entry.second.executed, address))
+        lines.push_back(address);
+    }
+  }
+  std::sort(lines.begin(), lines.end());
+  lines.erase(std::unique(lines.begin(), lines.end()), lines.end());
+
+  auto executed = [this](uint64_t address) {
+    const page *code = find_page(address);
+    return code && get_bit(code->executed, address);
+  };
+  auto line = [](uint64_t address) { return (address >> 2) + 1; };
+
+  // A file name of - is standard output, as for lcov
+  std::ofstream output_file;
+  if (file_name != "-")
+    output_file.open(file_name);
+  std::ostream &output = file_name == "-" ? std::cout : output_file;
+  output << std::dec << "TN:\nSF:" << source_name << "\n";
+  unsigned int functions_hit = 0;
+  for (const symbol_table::function &function : functions)
+    output << "FN:" << line(function.address) << "," << function.name
+           << "\n";
+  for (const symbol_table::function &function : functions) {
+    bool hit = executed(function.address);
+    functions_hit += hit;
+    output << "FNDA:" << hit << "," << function.name << "\n";
+  }
+  output << "FNF:" << functions.size() << "\nFNH:" << functions_hit << "\n";
+  unsigned int branches = 0;
+  unsigned int branches_hit = 0;
+  for (uint64_t address : lines) {
+    // Conditional branches have the BRANCH major opcode. Branches which
+    // have gone either way are known even if the code is not in memory.
+    const page *code = find_page(address);
+    bool directions[2] = {code && get_bit(code->taken, address),
+                          code && get_bit(code->not_taken, address)};
+    if (!directions[0] && !directions[1] &&
+        (main_memory->read32(address) & 0x7f) != 0x63)
+      continue;
+    bool reached = executed(address);
+    for (unsigned int block = 0; block < 2; block++) {
+      output << "BRDA:" << line(address) << ",0," << block << ",";
+      if (reached)
+        output << directions[block] << "\n";
+      else
+        output << "-\n";
+      branches_hit += directions[block];
+    }
+    branches += 2;
+  }
+  output << "BRF:" << branches << "\nBRH:" << branches_hit << "\n";
+  unsigned int lines_hit = 0;
+  for (uint64_t address : lines) {
+    bool hit = executed(address);
+    lines_hit += hit;
+    output << "DA:" << line(address) << "," << hit << "\n";
+  }
+  output << "LF:" << lines.size() << "\nLH:" << lines_hit
+         << "\nend_of_record\n";
+  return output.good();
+}
+
+bool code_coverage::get_bit(const bitmap &map, uint64_t address) {
+  uint64_t slot = (address >> 2) & ((1 << slot_bits) - 1);
+  return (map[slot >> 6] >> (slot & 63)) & 1;
+}
+
+const code_coverage::page *code_coverage::find_page(uint64_t address) const {
+  auto entry = this->pages.find(address >> page_bits);
+  return entry == this->pages.end() ? nullptr : &entry->second;
+}
@@ -0,0 +1,87 @@
+#ifndef CODE_COVERAGE_H
+#define CODE_COVERAGE_H
+
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class for execution coverage
+
+**************************************************************** */
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+#include "memory.h"
+#include "symbols.h"
+
+// Records which instructions have executed, and which directions each branch
+// has gone, a bit at a time. The bits for each 4 Kbyte page of code are kept
+// together, so recording costs a compare against the page of the last
+// instruction and an OR. Coverage may be saved as raw bitmaps, which are
+// merged into the coverage of later runs as they are loaded, or exported in
+// lcov's tracefile format.
+class code_coverage {
+
+public:
+  // Constructor
+  code_coverage();
+
+  void executed(uint64_t address) {
+    set_bit(bits(address).executed, address);
+  }
+  void branch(uint64_t address, bool taken) {
+    page &code = bits(address);
+    set_bit(taken ? code.taken : code.not_taken, address);
+  }
+
+  // Write the raw bitmaps, or merge the bitmaps in a file into ours. Return
+  // false on failure.
+  bool save(std::string file_name);
+  bool merge(std::string file_name);
+
+  // Write an lcov tracefile for a source named source_name, to standard output
+  // if file_name is -. Each instruction is a line, numbered by its address
+  // divided by 4 plus 1, and the symbols' functions are the functions.
+  // Branches are found from their bitmaps, and by reading instructions from
+  // memory, so branches which have never executed are only found if the
+  // program is loaded. Returns false on failure.
+  bool write_lcov(std::string file_name, std::string source_name,
+                  const symbol_table &symbols, memory *main_memory);
+
+private:
+  static constexpr unsigned int page_bits = 12;
+  // Instructions are 4 bytes and aligned, so a page holds 1024
+  static constexpr unsigned int slot_bits = page_bits - 2;
+  typedef std::array<uint64_t, (1 << slot_bits) / 64> bitmap;
+  struct page {
+    bitmap executed;
+    bitmap taken;
+    bitmap not_taken;
+  };
+
+  // Nodes of an unordered_map are never moved, so the page of the last
+  // instruction can be kept
+  std::unordered_map<uint64_t, page> pages;
+  uint64_t last_key;
+  page *last_page;
+
+  page &bits(uint64_t address) {
+    uint64_t key = address >> page_bits;
+    if (key != this->last_key || !this->last_page) {
+      this->last_page = &this->pages[key];
+      this->last_key = key;
+    }
+    return *this->last_page;
+  }
+  static void set_bit(bitmap &map, uint64_t address) {
+    uint64_t slot = (address >> 2) & ((1 << slot_bits) - 1);
+    map[slot >> 6] |= 1ULL << (slot & 63);
+  }
+  static bool get_bit(const bitmap &map, uint64_t address);
+  const page *find_page(uint64_t address) const;
+};
+
+#endif
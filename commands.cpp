@@ -9,11 +9,13 @@
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <vector>
 #include <iomanip>
 #include <ctype.h>
 
 #include "memory.h"
 #include "processor.h"
+#include "symbols.h"
 #include "commands.h"
 
 void command_skip_optional_whitespace(std::string& command, unsigned int& i) { 
@@ -39,6 +41,16 @@ bool command_match_decimal_number(std::string& command, unsigned int& i, unsigne
 }
 
 
+bool command_match_decimal_number(std::string& command, unsigned int& i, uint64_t& num) { 
+  unsigned int j = i;
+  while (j < command.length() && isdigit(command[j])) j++;
+  if (j == i) return false;
+  std::stringstream(command.substr(i, j - i)) >> num;
+  i = j;
+  return true;
+}
+
+
 bool command_match_hex_number(std::string& command, unsigned int& i, uint64_t& num) { 
   unsigned int j = i;
   while (j < command.length() && isxdigit(command[j])) j++;
@@ -121,24 +133,32 @@ bool command_match_dot(std::string& command, unsigned int i, bool& num_present,
 }
 
 
-bool command_match_b(std::string& command, unsigned int i, bool& address_present, uint64_t& address) {
+// The breakpoint may be a symbol or a hex address. A name made only of hex
+// digits is both, and the symbol is used if there is one.
+bool command_match_b(std::string& command, unsigned int i, bool& address_present, uint64_t& address, std::string& symbol, bool& hex) {
   address_present = false;
+  hex = false;
+  symbol.clear();
   if (i == command.length() || command[i] != 'b') return false;
   i++;
   if (i == command.length() || command[i] == '#') return true;
   if (!command_skip_required_whitespace(command, i)) return false;
-  if (command_match_hex_number(command, i, address)) {
+  unsigned int j = i;
+  while (j < command.length() && !isspace(command[j]) && command[j] != '#') j++;
+  if (j > i) {
     address_present = true;
+    symbol = command.substr(i, j - i);
+    unsigned int k = i;
+    hex = command_match_hex_number(command, k, address) && k == j;
+    i = j;
     command_skip_optional_whitespace(command, i);
   }
   return i == command.length() || command[i] == '#';
 }
 
 
-bool command_match_l(std::string& command, unsigned int i, std::string& filename) {
+bool command_match_filename(std::string& command, unsigned int i, std::string& filename) {
   unsigned int j;
-  if (i == command.length() || command[i] != 'l') return false;
-  i++;
   if (!command_skip_required_whitespace(command, i)) return false;
   if (i == command.length() || command[i] != '"') return false;
   i++;
@@ -153,6 +173,67 @@ bool command_match_l(std::string& command, unsigned int i, std::string& filename
 }
 
 
+bool command_match_l(std::string& command, unsigned int i, std::string& filename) {
+  if (i == command.length() || command[i] != 'l') return false;
+  i++;
+  return command_match_filename(command, i, filename);
+}
+
+
+bool command_match_save(std::string& command, unsigned int i, std::string& filename) {
+  if (command.compare(i, 4, "save") != 0) return false;
+  i += 4;
+  return command_match_filename(command, i, filename);
+}
+
+
+bool command_match_restore(std::string& command, unsigned int i, std::string& filename) {
+  if (command.compare(i, 7, "restore") != 0) return false;
+  i += 7;
+  return command_match_filename(command, i, filename);
+}
+
+
+bool command_match_rs(std::string& command, unsigned int i, bool& num_present, unsigned int& num) {
+  num_present = false;
+  if (command.compare(i, 2, "rs") != 0) return false;
+  i += 2;
+  if (i == command.length() || command[i] == '#') return true;
+  if (!command_skip_required_whitespace(command, i)) return false;
+  if (command_match_decimal_number(command, i, num)) {
+    num_present = true;
+    command_skip_optional_whitespace(command, i);
+  }
+  return i == command.length() || command[i] == '#';
+}
+
+
+bool command_match_rc(std::string& command, unsigned int i) {
+  if (command.compare(i, 2, "rc") != 0) return false;
+  i += 2;
+  command_skip_optional_whitespace(command, i);
+  return i == command.length() || command[i] == '#';
+}
+
+
+bool command_match_stats(std::string& command, unsigned int i) {
+  if (command.compare(i, 5, "stats") != 0) return false;
+  i += 5;
+  command_skip_optional_whitespace(command, i);
+  return i == command.length() || command[i] == '#';
+}
+
+
+bool command_match_goto(std::string& command, unsigned int i, uint64_t& count) {
+  if (command.compare(i, 4, "goto") != 0) return false;
+  i += 4;
+  if (!command_skip_required_whitespace(command, i)) return false;
+  if (!command_match_decimal_number(command, i, count)) return false;
+  command_skip_optional_whitespace(command, i);
+  return i == command.length() || command[i] == '#';
+}
+
+
 bool command_match_prv(std::string& command, unsigned int i, bool& num_present, unsigned int& num) {
   num_present = false;
   if (i == command.length() || command[i] != 'p') return false;
@@ -196,14 +277,16 @@ bool command_match_csr(std::string& command, unsigned int i, bool& data_present,
 
 
 // Command interpreter function
-void interpret_commands(memory* main_memory, processor* cpu, bool verbose) {
+// Changes to the machine are bracketed by calls to the history, if reverse
+// execution is enabled, so that they can be recorded
+void interpret_commands(memory* main_memory, processor* cpu, symbol_table* symbols, time_travel* history, bool verbose) {
 
   std::string command;
   unsigned int i;
-  bool address_present, data_present, num_present;
-  uint64_t address, data;
+  bool address_present, data_present, num_present, hex;
+  uint64_t address, data, count;
   unsigned int num;
-  std::string filename;
+  std::string filename, symbol;
 
   while (true) {
     std::getline(std::cin, command);  // Read the next line of input
@@ -221,7 +304,9 @@ void interpret_commands(memory* main_memory, processor* cpu, bool verbose) {
         cpu->show_reg(num);  // so just show register value
       }
       else {
+        if (history) history->begin_change();
         cpu->set_reg(num, data);  // Update register
+        if (history) history->end_change(true);
       }
     }
     else if (command_match_pc(command, i, address_present, address)) {  // Check for pc command 
@@ -229,7 +314,9 @@ void interpret_commands(memory* main_memory, processor* cpu, bool verbose) {
         cpu->show_pc();  // so just show pc value
       }
       else {
+        if (history) history->begin_change();
         cpu->set_pc(address);  // Update pc
+        if (history) history->end_change(true);
       }
     }
     else if (command_match_m(command, i, data_present, address, data)) {  // Check for m command
@@ -238,36 +325,87 @@ void interpret_commands(memory* main_memory, processor* cpu, bool verbose) {
         std::cout << std::setw(16) << std::setfill('0') << std::hex << data << std::endl;
       }
       else {  // Update memory doubleword
+        if (history) history->begin_change();
         main_memory->write_doubleword(address, data, 0xffffffffffffffffULL);
+        if (history) history->end_change(true);
       }
     }
     else if (command_match_dot(command, i, num_present, num)) {  // Check for . command
+      if (history) history->begin_change();
       if (!num_present) {  // No instruction count value
         cpu->execute(1, false);  // so just execute one instruction without breakpoint check
+        main_memory->flush_devices();
       }
       else {
         cpu->execute(num, true);  // Execute specified number of instructions with breakpoint check
+        main_memory->flush_devices();
       }
+      if (history) history->end_change(false);
     }
-    else if (command_match_b(command, i, address_present, address)) {  // Check for b command
+    else if (command_match_b(command, i, address_present, address, symbol, hex)) {  // Check for b command
+      uint64_t symbol_address;
       if (!address_present) {  // No address value
         cpu->clear_breakpoint();  // so just clear breakpoint
       }
-      else {
+      else if (symbols->find(symbol, symbol_address)) {  // Breakpoint at a symbol
+        cpu->set_breakpoint(symbol_address);
+      }
+      else if (hex) {
         cpu->set_breakpoint(address);  // Set breakpoint at the address
       }
+      else {
+        std::cout << "Unknown symbol" << std::endl;
+      }
     }
     else if (command_match_l(command, i, filename)) {  // Check for l command
       uint64_t start_address;
+      if (history) history->begin_change();
       if (main_memory->load_file(filename, start_address)) {  // Load using the specified file name
         cpu->set_pc(start_address);
+        if (symbol_table::is_elf(filename)) symbols->load_file(filename);  // Keep symbols for breakpoints
+      }
+      if (history) history->end_change(true);
+    }
+    else if (command_match_save(command, i, filename)) {  // Check for save command
+      std::vector<uint64_t> state;
+      cpu->save_state(state);
+      if (!main_memory->save_snapshot(filename, state)) {
+        std::cout << "Failed to save snapshot" << std::endl;
       }
     }
+    else if (command_match_restore(command, i, filename)) {  // Check for restore command
+      std::vector<uint64_t> state;
+      if (history) history->begin_change();
+      if (main_memory->restore_snapshot(filename, state, processor::state_size)) {
+        cpu->restore_state(state);
+      }
+      else {
+        std::cout << "Failed to restore snapshot" << std::endl;
+      }
+      if (history) history->end_change(true);
+    }
+    else if (command_match_rs(command, i, num_present, num)) {  // Check for rs command
+      if (!history) std::cout << "Reverse execution not enabled" << std::endl;
+      else history->reverse_step(num_present ? num : 1);
+    }
+    else if (command_match_rc(command, i)) {  // Check for rc command
+      if (!history) std::cout << "Reverse execution not enabled" << std::endl;
+      else history->reverse_continue();
+    }
+    else if (command_match_goto(command, i, count)) {  // Check for goto command
+      if (!history) std::cout << "Reverse execution not enabled" << std::endl;
+      else history->go_to(count);
+    }
+    else if (command_match_stats(command, i)) {  // Check for stats command
+      main_memory->show_statistics();  // Memory statistics so far
+    }
     else if (command_match_prv(command, i, num_present, num)) {  // Check for prv command
       if (!num_present) { // No new privilege level
         cpu->show_prv();  // so just show current privilege level
       } else if (num == 0 || num == 3) {
+        if (history) history->begin_change();
         cpu->set_prv(num);  // Set the current privilege level
+        if (history) history->end_change(true);
       } else {
           std::cout << "Incorrect privilege level" << std::endl;
       }
@@ -280,7 +418,9 @@ void interpret_commands(memory* main_memory, processor* cpu, bool verbose) {
         cpu->show_csr(address);  // so just show memory word value
       }
       else {
+        if (history) history->begin_change();
         cpu->set_csr(address, data);  // Update memory word
+        if (history) history->end_change(true);
       }
     }
     else {
@@ -11,7 +11,10 @@
 
 #include "memory.h"
 #include "processor.h"
+#include "symbols.h"
+#include "time_travel.h"
 
-void interpret_commands(memory* main_memory, processor* cpu, bool verbose);
+// Reverse execution commands are only available if history is not nullptr
+void interpret_commands(memory* main_memory, processor* cpu, symbol_table* symbols, time_travel* history, bool verbose);
 
 #endif
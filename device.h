@@ -0,0 +1,43 @@
+#ifndef DEVICE_H
+#define DEVICE_H
+
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Interface for memory-mapped devices
+
+**************************************************************** */
+
+#include <cstdint>
+
+// A device attached to memory over an address range. Accesses are passed the
+// doubleword-aligned offset from the start of the range, and the current tick
+// count of the processor.
+class device {
+
+public:
+  static constexpr uint64_t never = ~0ULL;
+
+  virtual ~device() {}
+
+  // Read a doubleword of registers. The mask contains 1s for the bytes being
+  // read, so registers with read side effects are only affected when read.
+  virtual uint64_t read_doubleword(uint64_t offset, uint64_t mask,
+                                   uint64_t now) = 0;
+
+  // Write a doubleword of registers. The mask contains 1s for bytes to be
+  // updated.
+  virtual void write_doubleword(uint64_t offset, uint64_t data, uint64_t mask,
+                                uint64_t now) = 0;
+
+  // Called once the tick count reaches the tick returned by the previous call,
+  // and once when the device is attached. Returns the tick at which to be
+  // called next, or never.
+  virtual uint64_t tick(uint64_t now) { return never; }
+
+  // Write out any buffered host output
+  virtual void flush() {}
+};
+
+#endif
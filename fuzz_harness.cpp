@@ -0,0 +1,255 @@
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class members for the persistent fuzzing harness
+
+**************************************************************** */
+
+#include <algorithm>
+#include <csignal>
+#include <cstdlib>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <sys/shm.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "fuzz_harness.h"
+#include "processor.h"
+
+constexpr int fuzz_harness::control_fd;
+constexpr int fuzz_harness::status_fd;
+
+// Constructor
+fuzz_harness::fuzz_harness(memory *main_memory, processor *cpu,
+                           uint64_t limit)
+    : main_memory(main_memory), cpu(cpu),
+      limit(std::min<uint64_t>(limit,
+                               std::numeric_limits<unsigned int>::max())),
+      buffer(0), buffer_size(0), return_address(0),
+      zero_page(1ULL << memory::page_bits), generation(0),
+      afl_bitmap(nullptr), bitmap(processor::coverage_size), crash_cause(0),
+      crash_pc(0), crashed(false) {}
+
+fuzz_harness::~fuzz_harness() {
+  this->cpu->set_coverage(nullptr);
+  this->cpu->set_exception_hook(nullptr);
+  if (this->afl_bitmap)
+    shmdt(this->afl_bitmap);
+}
+
+// Environment calls are serviced as usual, by the program's trap handler or
+// the system call proxy, and interrupts are taken. Any other exception is a
+// crash.
+bool fuzz_harness::start(uint64_t entry) {
+  this->cpu->set_breakpoint(entry, false);
+  while (this->cpu->get_pc() != entry && !this->cpu->is_halted())
+    this->cpu->execute(std::numeric_limits<unsigned int>::max(), true);
+  if (this->cpu->is_halted())
+    return false;
+  this->buffer = this->cpu->get_reg(10);
+  this->buffer_size = this->cpu->get_reg(11);
+  this->return_address = this->cpu->get_reg(1);
+  this->cpu->set_breakpoint(this->return_address, false);
+  this->cpu->save_state(this->state);
+  this->generation = this->main_memory->track_dirty_pages();
+  this->main_memory->stored_pages(this->keys);
+  this->main_memory->copy_pages(this->keys, this->contents);
+  this->cpu->set_exception_hook([this](uint64_t cause) {
+    if ((cause >> 63) || cause == 8 || cause == 9 || cause == 11)
+      return false;
+    this->crashed = true;
+    this->crash_cause = cause;
+    this->crash_pc = this->cpu->get_pc();
+    return true;
+  });
+  return true;
+}
+
+fuzz_harness::outcome fuzz_harness::run(const std::vector<uint8_t> &input) {
+  uint64_t size = std::min<uint64_t>(input.size(), this->buffer_size);
+  this->main_memory->write_block(this->buffer, input.data(), size);
+  this->cpu->set_reg(10, this->buffer);
+  this->cpu->set_reg(11, size);
+  this->cpu->set_coverage(this->afl_bitmap ? this->afl_bitmap
+                                           : this->bitmap.data());
+  this->crashed = false;
+  this->cpu->execute(static_cast<unsigned int>(this->limit), true);
+  outcome result;
+  if (this->crashed)
+    result = outcome::Crashed;
+  else if (this->cpu->is_halted())
+    result = outcome::Exited;
+  else if (this->cpu->get_pc() == this->return_address)
+    result = outcome::Returned;
+  else
+    result = outcome::Hung;
+  this->cpu->set_coverage(nullptr);
+  reset();
+  return result;
+}
+
+// Pages written by the run are copied back from the saved pages, or cleared
+// if they were zero. The copies are made in the generation of the run, so the
+// next run starts with no pages dirty.
+void fuzz_harness::reset() {
+  uint64_t page_size = 1ULL << memory::page_bits;
+  this->main_memory->dirty_pages(this->generation, this->dirty);
+  for (uint64_t key : this->dirty) {
+    auto saved = std::lower_bound(this->keys.begin(), this->keys.end(), key);
+    const uint8_t *data = this->zero_page.data();
+    if (saved != this->keys.end() && *saved == key)
+      data = this->contents.data() +
+             ((saved - this->keys.begin()) << memory::page_bits);
+    this->main_memory->write_block(key << memory::page_bits, data, page_size);
+  }
+  this->generation = this->main_memory->start_dirty_generation();
+  this->cpu->restore_state(this->state);
+}
+
+bool fuzz_harness::attach_afl_bitmap() {
+  const char *id = getenv("__AFL_SHM_ID");
+  if (!id)
+    return false;
+  void *mapping = shmat(atoi(id), nullptr, 0);
+  if (mapping == reinterpret_cast<void *>(-1))
+    return false;
+  this->afl_bitmap = static_cast<uint8_t *>(mapping);
+  return true;
+}
+
+// The fork server forks a child which runs inputs until one crashes, and
+// stops itself after each. AFL++ is told the child's status when it stops,
+// and the child is continued for the next input, as in AFL++'s persistent
+// mode. A child which crashes is replaced by a new fork of the saved machine.
+bool fuzz_harness::serve_fork_server() {
+  uint32_t message = 0;
+  if (fcntl(control_fd, F_GETFD) == -1 || fcntl(status_fd, F_GETFD) == -1 ||
+      write(status_fd, &message, sizeof(message)) != sizeof(message))
+    return false;
+  pid_t child = -1;
+  bool stopped = false;
+  int status;
+  while (read(control_fd, &message, sizeof(message)) == sizeof(message)) {
+    // A message other than 0 says that the stopped child was killed after
+    // timing out
+    if (stopped && message != 0) {
+      waitpid(child, &status, 0);
+      stopped = false;
+    }
+    if (stopped) {
+      kill(child, SIGCONT);
+    } else {
+      std::cout << std::flush;
+      child = fork();
+      if (child < 0)
+        break;
+      if (child == 0)
+        serve_child();
+    }
+    int32_t pid = child;
+    if (write(status_fd, &pid, sizeof(pid)) != sizeof(pid) ||
+        waitpid(child, &status, WUNTRACED) < 0)
+      break;
+    stopped = WIFSTOPPED(status);
+    if (write(status_fd, &status, sizeof(status)) != sizeof(status))
+      break;
+  }
+  if (child > 0 && stopped) {
+    kill(child, SIGKILL);
+    waitpid(child, &status, 0);
+  }
+  return true;
+}
+
+// A crash aborts the child so that AFL++ sees it killed by a signal. A child
+// which hangs waits to be killed when AFL++ times it out.
+void fuzz_harness::serve_child() {
+  close(control_fd);
+  close(status_fd);
+  std::vector<uint8_t> input;
+  while (true) {
+    read_input(STDIN_FILENO, input);
+    outcome result = run(input);
+    if (result == outcome::Crashed)
+      abort();
+    if (result == outcome::Hung) {
+      while (true)
+        pause();
+    }
+    raise(SIGSTOP);
+  }
+}
+
+unsigned int fuzz_harness::run_files(std::string path) {
+  std::vector<std::string> names;
+  struct stat status;
+  if (stat(path.c_str(), &status) == 0 && S_ISDIR(status.st_mode)) {
+    if (DIR *directory = opendir(path.c_str())) {
+      while (struct dirent *entry = readdir(directory)) {
+        std::string name = path + "/" + entry->d_name;
+        if (stat(name.c_str(), &status) == 0 && S_ISREG(status.st_mode))
+          names.push_back(name);
+      }
+      closedir(directory);
+    }
+    std::sort(names.begin(), names.end());
+  } else {
+    names.push_back(path);
+  }
+  unsigned int crashes = 0;
+  std::vector<uint8_t> input;
+  for (const std::string &name : names) {
+    int fd = open(name.c_str(), O_RDONLY);
+    if (fd < 0) {
+      std::cout << name << ": Could not read input" << std::endl;
+      continue;
+    }
+    read_input(fd, input);
+    close(fd);
+    std::fill(this->bitmap.begin(), this->bitmap.end(), 0);
+    outcome result = run(input);
+    std::cout << name << ": ";
+    switch (result) {
+    case outcome::Returned:
+      std::cout << "returned";
+      break;
+    case outcome::Exited:
+      std::cout << "exited";
+      break;
+    case outcome::Crashed:
+      ++crashes;
+      std::cout << "crashed with mcause " << std::setw(16) << std::setfill('0')
+                << std::hex << this->crash_cause << " at " << std::setw(16)
+                << this->crash_pc;
+      break;
+    case outcome::Hung:
+      std::cout << "hung after " << std::dec << this->limit
+                << " instructions";
+      break;
+    }
+    if (!this->afl_bitmap)
+      std::cout << ", " << std::dec
+                << std::count_if(this->bitmap.begin(), this->bitmap.end(),
+                                 [](uint8_t count) { return count != 0; })
+                << " edges";
+    std::cout << std::endl;
+  }
+  return crashes;
+}
+
+// AFL++ rewinds the input file before each run, as is done here for files
+// read more than once
+void fuzz_harness::read_input(int fd, std::vector<uint8_t> &input) {
+  uint8_t chunk[4096];
+  ssize_t length;
+  input.clear();
+  lseek(fd, 0, SEEK_SET);
+  while ((length = read(fd, chunk, sizeof(chunk))) > 0)
+    input.insert(input.end(), chunk, chunk + length);
+}
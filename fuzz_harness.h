@@ -0,0 +1,99 @@
+#ifndef FUZZ_HARNESS_H
+#define FUZZ_HARNESS_H
+
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class for the persistent fuzzing harness
+
+**************************************************************** */
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "memory.h"
+
+class processor;
+
+// Runs a guest fuzz target once per input without reloading the program. The
+// program is run to the entry point of the target, a function called like
+// LLVMFuzzerTestOneInput with a buffer in a0 and its size in a1, and the
+// machine is saved there. Each input is written to the buffer, with its size
+// in a1, and run until the target returns. Only the pages written by the run
+// are restored afterwards, along with the registers, so a run costs time in
+// proportion to the pages it dirties rather than the size of the program.
+class fuzz_harness {
+
+public:
+  enum class outcome {
+    Returned,
+    Exited,
+    Crashed,
+    Hung,
+  };
+
+  // Constructor. Each run may execute up to limit instructions.
+  fuzz_harness(memory *main_memory, processor *cpu, uint64_t limit);
+  ~fuzz_harness();
+
+  // Run the program to the entry point, and save the machine there. Returns
+  // false if the program halts before reaching it.
+  bool start(uint64_t entry);
+
+  // Run one input, leaving the machine as it was saved. Inputs longer than
+  // the buffer are cut short.
+  outcome run(const std::vector<uint8_t> &input);
+
+  // Count edges in the AFL++ shared memory bitmap named by __AFL_SHM_ID.
+  // Returns false if there is none.
+  bool attach_afl_bitmap();
+
+  // Serve runs of inputs read from standard input to an AFL++ fork server
+  // client, on its control and status file descriptors. Returns false at
+  // once if no fuzzer is listening, or true once the fuzzer has gone.
+  bool serve_fork_server();
+
+  // Run an input file, or each file in a directory in name order, printing
+  // the outcome of each. Returns the number of crashes.
+  unsigned int run_files(std::string path);
+
+private:
+  // We do not have ownership over these objects! Do not free them!
+  memory *main_memory;
+  processor *cpu;
+
+  uint64_t limit;
+  uint64_t buffer;
+  uint64_t buffer_size;
+  uint64_t return_address;
+
+  // The machine at the entry point, and the pages which were not zero
+  std::vector<uint64_t> state;
+  std::vector<uint64_t> keys;
+  std::vector<uint8_t> contents;
+  std::vector<uint8_t> zero_page;
+  // Dirty page generation since the machine was last restored
+  uint64_t generation;
+  std::vector<uint64_t> dirty;
+
+  // AFL++ bitmap, or a bitmap of our own for reporting coverage
+  uint8_t *afl_bitmap;
+  std::vector<uint8_t> bitmap;
+
+  // Exception of the last run which crashed, and where it was raised
+  uint64_t crash_cause;
+  uint64_t crash_pc;
+  bool crashed;
+
+  // Fork server file descriptors of AFL++
+  static constexpr int control_fd = 198;
+  static constexpr int status_fd = 199;
+
+  void reset();
+  void serve_child();
+  static void read_input(int fd, std::vector<uint8_t> &input);
+};
+
+#endif
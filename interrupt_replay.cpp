@@ -0,0 +1,65 @@
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class members for replaying a script of external interrupts
+
+**************************************************************** */
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "interrupt_replay.h"
+#include "processor.h"
+
+// Constructor
+interrupt_replay::interrupt_replay(processor *cpu, scheduler *events,
+                                   plic *controller)
+    : cpu(cpu), events(events), controller(controller) {}
+
+bool interrupt_replay::load_file(std::string file_name) {
+  std::ifstream input_file(file_name);
+  if (!input_file.is_open()) {
+    std::cout << "Failed to open interrupt replay file" << std::endl;
+    return false;
+  }
+  std::string line;
+  unsigned int line_count = 0;
+  while (std::getline(input_file, line)) {
+    line_count++;
+    std::istringstream fields(line.substr(0, line.find('#')));
+    uint64_t count;
+    unsigned int source;
+    std::string rest;
+    if (!(fields >> count)) {
+      if (fields.eof())
+        continue; // Blank or comment line
+    } else if (fields >> source && source > 0 && source < plic::sources &&
+               !(fields >> rest)) {
+      schedule(count, source);
+      continue;
+    }
+    std::cout << "Invalid interrupt replay line " << std::dec << line_count
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Scheduler time is in ticks, which run ahead of the instruction count when
+// WFI skips idle ticks, so an event that comes due early is deferred by the
+// difference
+void interrupt_replay::schedule(uint64_t count, unsigned int source) {
+  uint64_t ticks = this->cpu->get_ticks();
+  uint64_t instructions = this->cpu->get_instruction_count();
+  uint64_t time = count > instructions ? ticks + (count - instructions) : ticks;
+  this->events->schedule(time, [this, count, source](uint64_t) {
+    if (this->cpu->get_instruction_count() < count) {
+      schedule(count, source);
+      return;
+    }
+    this->controller->set_level(source, true);
+    this->controller->set_level(source, false);
+  });
+}
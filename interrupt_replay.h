@@ -0,0 +1,43 @@
+#ifndef INTERRUPT_REPLAY_H
+#define INTERRUPT_REPLAY_H
+
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class for replaying a script of external interrupts
+
+**************************************************************** */
+
+#include <cstdint>
+#include <string>
+
+#include "plic.h"
+#include "scheduler.h"
+
+class processor;
+
+// Each line of a replay script gives a retired instruction count and a PLIC
+// source, which is pulsed (made pending) once that many instructions have
+// retired. Text after # is a comment. Events are posted to the scheduler, so
+// the processor only checks the next event time as it runs.
+class interrupt_replay {
+
+public:
+  // Constructor
+  interrupt_replay(processor *cpu, scheduler *events, plic *controller);
+
+  // Read a script and schedule its events. Return true if the file was read
+  // without error, or false otherwise.
+  bool load_file(std::string file_name);
+
+private:
+  // We do not have ownership over these objects! Do not free them!
+  processor *cpu;
+  scheduler *events;
+  plic *controller;
+
+  void schedule(uint64_t count, unsigned int source);
+};
+
+#endif
@@ -6,32 +6,462 @@
 
 **************************************************************** */
 
+#include <algorithm>
+#include <cctype>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <elf.h>
+#include <fcntl.h>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <map>
+#include <new>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "memory.h"
+#include "page_codec.h"
+
+// Arena chunks are allocated with calloc, so the host only provides pages of
+// a chunk as they are used
+static constexpr size_t arena_chunk_size = 16 << 20;
+static constexpr size_t arena_alignment = 64;
+
+memory::arena::arena() : next(nullptr), remaining(0) {}
+
+memory::arena::~arena() {
+  for (void *chunk : this->chunks)
+    free(chunk);
+}
+
+void *memory::arena::allocate(size_t size) {
+  size = (size + arena_alignment - 1) & ~(arena_alignment - 1);
+  if (size > this->remaining) {
+    size_t chunk_size = std::max(size, arena_chunk_size);
+    void *chunk = calloc(1, chunk_size);
+    if (chunk == nullptr)
+      throw std::bad_alloc();
+    this->chunks.push_back(chunk);
+    this->next = static_cast<uint8_t *>(chunk);
+    this->remaining = chunk_size;
+  }
+  void *block = this->next;
+  this->next += size;
+  this->remaining -= size;
+  return block;
+}
+
+// Page pool chunks are reserved without backing, and hold many pages
+static constexpr size_t pool_chunk_size = 64 << 20;
+static_assert(memory::page_bits <= 21, "memory pages larger than huge pages");
+
+memory::page_pool::page_pool() : huge(false), next(nullptr), remaining(0) {}
+
+memory::page_pool::~page_pool() {
+  for (const auto &chunk : this->chunks)
+    munmap(chunk.first, chunk.second);
+}
+
+// Carve space from the current chunk, mapping a new one when it runs out.
+// With huge pages, chunks are aligned to the huge page size.
+uint8_t *memory::page_pool::allocate_chunk_space(size_t size) {
+  if (this->remaining < size) {
+    size_t alignment = this->huge ? 1ULL << huge_page_bits : 1;
+    size_t mapping_size = pool_chunk_size + alignment - 1;
+    void *chunk = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (chunk == MAP_FAILED)
+      throw std::bad_alloc();
+    this->chunks.push_back({chunk, mapping_size});
+    uintptr_t start = reinterpret_cast<uintptr_t>(chunk);
+    start = (start + alignment - 1) & ~(alignment - 1);
+    this->next = reinterpret_cast<uint8_t *>(start);
+    this->remaining = pool_chunk_size;
+    if (this->huge)
+      madvise(this->next, pool_chunk_size, MADV_HUGEPAGE);
+  }
+  uint8_t *space = this->next;
+  this->next += size;
+  this->remaining -= size;
+  return space;
+}
+
+uint64_t *memory::page_pool::allocate(uint64_t key) {
+  if (this->huge) {
+    uint64_t region = key >> (huge_page_bits - page_bits);
+    uint8_t *&base = this->regions[region];
+    if (base == nullptr)
+      base = allocate_chunk_space(1ULL << huge_page_bits);
+    uint64_t offset = key & ((1ULL << (huge_page_bits - page_bits)) - 1);
+    return reinterpret_cast<uint64_t *>(base + (offset << page_bits));
+  }
+  if (!this->free_pages.empty()) {
+    uint64_t *page = this->free_pages.back();
+    this->free_pages.pop_back();
+    return page;
+  }
+  return reinterpret_cast<uint64_t *>(allocate_chunk_space(1ULL << page_bits));
+}
+
+void memory::page_pool::free(uint64_t *page) {
+  if (this->huge) {
+    memset(page, 0, 1ULL << page_bits);
+    return;
+  }
+  madvise(page, 1ULL << page_bits, MADV_DONTNEED);
+  this->free_pages.push_back(page);
+}
+
+uint64_t memory::page_pool::held_after(uint64_t key,
+                                       uint64_t page_count) const {
+  if (!this->huge)
+    return (page_count + 1) << page_bits;
+  uint64_t region = key >> (huge_page_bits - page_bits);
+  uint64_t count = this->regions.size() + (this->regions.count(region) ? 0 : 1);
+  return count << huge_page_bits;
+}
+
+// The host reports the huge pages backing each mapping in /proc/self/smaps
+uint64_t memory::page_pool::huge_page_count() const {
+  std::ifstream smaps("/proc/self/smaps");
+  std::string line;
+  bool ours = false;
+  uint64_t kilobytes = 0;
+  while (std::getline(smaps, line)) {
+    uintptr_t start, end;
+    if (sscanf(line.c_str(), "%lx-%lx ", &start, &end) == 2) {
+      ours = false;
+      for (const auto &chunk : this->chunks) {
+        uintptr_t chunk_start = reinterpret_cast<uintptr_t>(chunk.first);
+        if (start >= chunk_start && start < chunk_start + chunk.second)
+          ours = true;
+      }
+    } else if (ours && line.compare(0, 14, "AnonHugePages:") == 0) {
+      kilobytes += strtoull(line.c_str() + 14, nullptr, 10);
+    }
+  }
+  return (kilobytes << 10) >> huge_page_bits;
+}
 
 // Constructor
-memory::memory(bool verbose) : verbose(verbose) {}
+memory::memory(bool verbose)
+    : root(), page_count(0), compressed_count(0), compressed_bytes(0),
+      limit(0), compress_after(0), deduplicate(false), sweep_interval(0),
+      next_sweep(device::never), compress_buffer(1ULL << page_bits),
+      window(nullptr), window_size(0), zero_page_shared(false), image_end(0),
+      now(0), next_tick(device::never), use_image_cache(false),
+      image_page_count(0), generation(1), replaced_generation(0),
+      log_start(1), verbose(verbose) {
+  this->root.shift = root_shift;
+  void *mapping = mmap(nullptr, 1ULL << page_bits, PROT_READ,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED)
+    throw std::bad_alloc();
+  this->zero_page = static_cast<uint64_t *>(mapping);
+}
+
+memory::~memory() {
+  for (page_frame *frame : this->all_frames)
+    delete[] frame->compressed;
+  munmap(this->zero_page, 1ULL << page_bits);
+  for (const auto &mapping : this->image_mappings)
+    munmap(mapping.first, mapping.second);
+  if (this->window)
+    munmap(this->window, this->window_size);
+}
+
+bool memory::map_window(uint64_t size) {
+  uint64_t page_size = 1ULL << page_bits;
+  size = (size + page_size - 1) & ~(page_size - 1);
+  void *mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mapping == MAP_FAILED)
+    return false;
+  if (this->window)
+    munmap(this->window, this->window_size);
+  this->window = static_cast<uint8_t *>(mapping);
+  this->window_size = size;
+  // Pages already held in the tree, such as device pages, stay there
+  this->window_framed.assign(((size >> page_bits) + 63) / 64, 0);
+  for (page_frame *frame : this->all_frames)
+    mark_window_frame(frame->key);
+  if (!this->window_generations.empty()) {
+    this->window_generations.assign(size >> page_bits, this->generation);
+    this->log_start = this->generation + 1;
+  }
+  invalidate_pages(0, size);
+  return true;
+}
+
+void memory::mark_window_frame(uint64_t key) {
+  if (key < (this->window_size >> page_bits))
+    this->window_framed[key >> 6] |= 1ULL << (key & 63);
+}
+
+memory::page_frame *memory::find_frame(uint64_t address, bool allocate) {
+  uint64_t key = address >> page_bits;
+  radix_node *node = &this->root;
+  uintptr_t *slot;
+  while (true) {
+    slot = &node->slots[(key >> node->shift) & (radix_size - 1)];
+    uintptr_t entry = *slot;
+    if (entry & 1) {
+      page_frame *frame = reinterpret_cast<page_frame *>(entry - 1);
+      if (frame->key == key)
+        return frame;
+      break;
+    }
+    if (entry == 0)
+      break;
+    radix_node *child = reinterpret_cast<radix_node *>(entry);
+    if (key >> (child->shift + radix_bits) != child->prefix)
+      break;
+    node = child;
+  }
+  if (!allocate)
+    return nullptr;
+
+  // Arena memory is zeroed, so the page starts out as zero RAM without
+  // storage of its own
+  page_frame *frame =
+      new (this->frames.allocate(sizeof(page_frame))) page_frame;
+  frame->key = key;
+  frame->last_used = this->now;
+  this->all_frames.push_back(frame);
+  uintptr_t entry = *slot;
+  uintptr_t frame_entry = reinterpret_cast<uintptr_t>(frame) + 1;
+  if (entry == 0) {
+    *slot = frame_entry;
+    return frame;
+  }
+  // The slot leads to a different page, or a node for different keys, so
+  // insert a node where their keys first differ
+  uint64_t other_key;
+  if (entry & 1) {
+    other_key = reinterpret_cast<page_frame *>(entry - 1)->key;
+  } else {
+    radix_node *child = reinterpret_cast<radix_node *>(entry);
+    other_key = child->prefix << (child->shift + radix_bits);
+  }
+  unsigned int highest = 63 - __builtin_clzll(key ^ other_key);
+  radix_node *split = new (this->frames.allocate(sizeof(radix_node))) radix_node;
+  split->shift = highest / radix_bits * radix_bits;
+  split->prefix = key >> (split->shift + radix_bits);
+  split->slots[(key >> split->shift) & (radix_size - 1)] = frame_entry;
+  split->slots[(other_key >> split->shift) & (radix_size - 1)] = entry;
+  *slot = reinterpret_cast<uintptr_t>(split);
+  return frame;
+}
+
+// Return the storage of a RAM page, allocating it or copying shared storage
+// for writes, and restoring it if it was compressed
+uint64_t *memory::frame_data(page_frame *frame, bool write) {
+  uint64_t page_size = 1ULL << page_bits;
+  frame->last_used = this->now;
+  if (write)
+    page_written(frame->key, frame->generation);
+  if (frame->compressed) {
+    uint64_t *data = allocate_page(frame->key);
+    page_codec::decompress(frame->compressed, frame->compressed_size,
+                           reinterpret_cast<uint8_t *>(data), page_size);
+    delete[] frame->compressed;
+    frame->compressed = nullptr;
+    this->compressed_bytes -= frame->compressed_size;
+    --this->compressed_count;
+    frame->data = data;
+  }
+  if (frame->data == nullptr) {
+    if (!write) {
+      this->zero_page_shared = true;
+      return this->zero_page;
+    }
+    frame->data = allocate_page(frame->key);
+    // Cached pointers may still lead to the zero page for this page
+    if (this->zero_page_shared)
+      invalidate_pages(frame->key << page_bits, page_size);
+  } else if (write && frame->shared) {
+    auto shared = this->shared_pages.find(frame->data);
+    if (shared != this->shared_pages.end()) {
+      uint64_t *copy = allocate_page(frame->key);
+      memcpy(copy, frame->data, page_size);
+      if (--shared->second == 1)
+        this->shared_pages.erase(shared);
+      frame->data = copy;
+      invalidate_pages(frame->key << page_bits, page_size);
+    }
+    frame->shared = false;
+  }
+  return frame->data;
+}
+
+// Allocate page storage, compressing the least recently used pages first if
+// the limit would be exceeded
+uint64_t *memory::allocate_page(uint64_t key) {
+  if (this->limit) {
+    if (this->pages.held_after(key, this->page_count) + this->compressed_bytes >
+        this->limit)
+      reclaim();
+    if (this->pages.held_after(key, this->page_count) + this->compressed_bytes >
+        this->limit)
+      throw limit_exceeded();
+  }
+  ++this->page_count;
+  return this->pages.allocate(key);
+}
+
+// Whether page storage is part of a mapped image cache rather than the pool
+bool memory::image_page(const uint64_t *data) {
+  for (const auto &mapping : this->image_mappings) {
+    const uint8_t *start = static_cast<const uint8_t *>(mapping.first);
+    const uint8_t *byte = reinterpret_cast<const uint8_t *>(data);
+    if (byte >= start && byte < start + mapping.second)
+      return true;
+  }
+  return false;
+}
+
+// Free the storage of a page, which is then zero unless it is compressed
+void memory::release_data(page_frame *frame) {
+  auto shared = frame->shared ? this->shared_pages.find(frame->data)
+                              : this->shared_pages.end();
+  if (shared != this->shared_pages.end()) {
+    if (--shared->second == 1)
+      this->shared_pages.erase(shared);
+  } else if (!image_page(frame->data)) {
+    this->pages.free(frame->data);
+    --this->page_count;
+  }
+  frame->data = nullptr;
+  frame->shared = false;
+}
+
+// Compress a page, or release its storage if it is all zeros. Pages which do
+// not compress to under three quarters of their size are left alone.
+bool memory::compress_frame(page_frame *frame) {
+  uint64_t page_size = 1ULL << page_bits;
+  const uint64_t *data = frame->data;
+  if (std::all_of(data, data + page_words,
+                  [](uint64_t word) { return word == 0; })) {
+    release_data(frame);
+    return true;
+  }
+  size_t size = page_codec::compress(reinterpret_cast<const uint8_t *>(data),
+                                     page_size, this->compress_buffer.data(),
+                                     page_size * 3 / 4);
+  if (size == 0)
+    return false;
+  frame->compressed = new uint8_t[size];
+  memcpy(frame->compressed, this->compress_buffer.data(), size);
+  frame->compressed_size = size;
+  this->compressed_bytes += size;
+  ++this->compressed_count;
+  release_data(frame);
+  return true;
+}
+
+// Share the storage of identical pages, found through a hash of each page,
+// and release pages which are all zeros
+void memory::merge_pages() {
+  uint64_t page_size = 1ULL << page_bits;
+  std::unordered_map<uint64_t, page_frame *> seen;
+  for (page_frame *frame : this->all_frames) {
+    if (frame->data == nullptr)
+      continue;
+    uint64_t hash = 0;
+    for (uint64_t i = 0; i < page_words; i++)
+      hash = (hash ^ frame->data[i]) * 0x100000001b3ULL;
+    if (hash == 0 && std::all_of(frame->data, frame->data + page_words,
+                                 [](uint64_t word) { return word == 0; })) {
+      release_data(frame);
+      continue;
+    }
+    auto other = seen.find(hash);
+    if (other == seen.end()) {
+      seen[hash] = frame;
+      continue;
+    }
+    uint64_t *data = other->second->data;
+    if (data == frame->data || memcmp(data, frame->data, page_size) != 0)
+      continue;
+    release_data(frame);
+    unsigned int &sharing = this->shared_pages[data];
+    sharing = std::max(sharing, 1U) + 1;
+    frame->data = data;
+    frame->shared = other->second->shared = true;
+  }
+}
+
+// Compress the least recently used quarter of the pages with storage, other
+// than those used this tick, whose pointers may still be held
+void memory::reclaim() {
+  std::vector<page_frame *> candidates;
+  for (page_frame *frame : this->all_frames) {
+    if (frame->data && !frame->shared && frame->last_used < this->now)
+      candidates.push_back(frame);
+  }
+  if (candidates.empty())
+    return;
+  invalidate_pages(0, ~0ULL);
+  size_t count = std::max<size_t>(candidates.size() / 4, 1);
+  std::partial_sort(candidates.begin(), candidates.begin() + count,
+                    candidates.end(), [](page_frame *a, page_frame *b) {
+                      return a->last_used < b->last_used;
+                    });
+  for (size_t i = 0; i < count; i++)
+    compress_frame(candidates[i]);
+}
 
-void memory::validate_address(uint64_t address) {
-  uint64_t key = address_key(address);
-  if (this->store.find(key) == this->store.end()) {
-    this->store[key] = {0};
+// Cached pointers are dropped first, so that pages used from here on are
+// looked up again and marked as used
+void memory::sweep() {
+  invalidate_pages(0, ~0ULL);
+  if (this->deduplicate)
+    merge_pages();
+  if (this->compress_after) {
+    for (page_frame *frame : this->all_frames) {
+      if (frame->data && !frame->shared &&
+          this->now - frame->last_used >= this->compress_after)
+        compress_frame(frame);
+    }
   }
 }
 
+// Sweeps run every half of the idle time for compression, so pages are
+// compressed within one and a half times it. Deduplication alone sweeps
+// every 2^24 ticks.
+void memory::set_compression(uint64_t idle_ticks) {
+  this->compress_after = idle_ticks;
+  set_deduplication(this->deduplicate);
+}
+
+void memory::set_deduplication(bool enabled) {
+  this->deduplicate = enabled;
+  this->sweep_interval = 0;
+  if (this->compress_after)
+    this->sweep_interval = std::max<uint64_t>(this->compress_after / 2, 1);
+  else if (enabled)
+    this->sweep_interval = 1ULL << 24;
+  this->next_sweep =
+      this->sweep_interval ? this->now + this->sweep_interval : device::never;
+  this->next_tick = 0;
+}
+
 // Read a doubleword of data from a doubleword-aligned address.
 // If the address is not a multiple of 8, it is rounded down to a multiple of 8.
-uint64_t memory::read_doubleword(uint64_t address) {
-  validate_address(address);
-  uint64_t key = address_key(address);
-  size_t index = address_index(address);
-  return this->store[key][index];
+uint64_t memory::read_doubleword(uint64_t address, uint64_t mask) {
+  if (uint64_t *host = window_page(address))
+    return host[address_index(address)];
+  // Pages which have never been written read as zero
+  page_frame *frame = find_frame(address, false);
+  if (frame == nullptr)
+    return 0;
+  if (frame->device)
+    return device_read(frame->device - 1, address, mask);
+  return frame_data(frame, false)[address_index(address)];
 }
 
 // Write a doubleword of data to a doubleword-aligned address.
@@ -39,112 +469,916 @@ uint64_t memory::read_doubleword(uint64_t address) {
 // The mask contains 1s for bytes to be updated and 0s for bytes that are to be
 // unchanged.
 void memory::write_doubleword(uint64_t address, uint64_t data, uint64_t mask) {
-  validate_address(address);
-  uint64_t value = (read_doubleword(address) & (~mask)) | (data & mask);
-  uint64_t key = address_key(address);
-  size_t index = address_index(address);
-  this->store[key][index] = value;
+  if (uint64_t *host = window_page(address)) {
+    window_written(address);
+    uint64_t &target = host[address_index(address)];
+    target = (target & (~mask)) | (data & mask);
+    return;
+  }
+  page_frame *frame = find_frame(address, true);
+  if (frame->device) {
+    device_write(frame->device - 1, address, data, mask);
+    return;
+  }
+  uint64_t &target = frame_data(frame, true)[address_index(address)];
+  target = (target & (~mask)) | (data & mask);
+}
+
+template <typename T> T memory::read_value(uint64_t address) {
+  const uint64_t *host = page(address, false);
+  if (host == nullptr) {
+    unsigned int shift = (address % 8) * 8;
+    uint64_t mask = (~0ULL >> (64 - 8 * sizeof(T))) << shift;
+    return read_doubleword(address, mask) >> shift;
+  }
+  T value;
+  memcpy(&value,
+         reinterpret_cast<const uint8_t *>(host) +
+             (address & ((1ULL << page_bits) - 1)),
+         sizeof(T));
+  return value;
+}
+
+template <typename T> void memory::write_value(uint64_t address, T value) {
+  uint64_t *host = page(address, true);
+  if (host == nullptr) {
+    unsigned int shift = (address % 8) * 8;
+    uint64_t mask = (~0ULL >> (64 - 8 * sizeof(T))) << shift;
+    write_doubleword(address, static_cast<uint64_t>(value) << shift, mask);
+    return;
+  }
+  memcpy(reinterpret_cast<uint8_t *>(host) +
+             (address & ((1ULL << page_bits) - 1)),
+         &value, sizeof(T));
+}
+
+uint8_t memory::read8(uint64_t address) { return read_value<uint8_t>(address); }
+uint16_t memory::read16(uint64_t address) {
+  return read_value<uint16_t>(address);
+}
+uint32_t memory::read32(uint64_t address) {
+  return read_value<uint32_t>(address);
+}
+uint64_t memory::read64(uint64_t address) {
+  return read_value<uint64_t>(address);
+}
+void memory::write8(uint64_t address, uint8_t value) {
+  write_value(address, value);
+}
+void memory::write16(uint64_t address, uint16_t value) {
+  write_value(address, value);
+}
+void memory::write32(uint64_t address, uint32_t value) {
+  write_value(address, value);
+}
+void memory::write64(uint64_t address, uint64_t value) {
+  write_value(address, value);
+}
+
+// Return the host storage for the page containing an address, the zero page
+// if it has not been written, or nullptr for a device page.
+uint64_t *memory::page(uint64_t address, bool write) {
+  if (uint64_t *host = window_page(address)) {
+    if (write)
+      window_written(address);
+    return host;
+  }
+  page_frame *frame = find_frame(address, write);
+  if (frame == nullptr) {
+    this->zero_page_shared = true;
+    return this->zero_page;
+  }
+  return frame->device ? nullptr : frame_data(frame, write);
+}
+
+// Copy a block of bytes into memory. Pages hold doublewords in host byte
+// order, which is little-endian like the guest, so bytes can be copied
+// directly.
+void memory::write_block(uint64_t address, const uint8_t *data,
+                         uint64_t size) {
+  uint64_t page_size = 1ULL << page_bits;
+  while (size > 0) {
+    uint64_t offset = address & (page_size - 1);
+    uint64_t length = std::min(size, page_size - offset);
+    uint64_t *host = page(address, true);
+    if (host) {
+      memcpy(reinterpret_cast<uint8_t *>(host) + offset, data, length);
+    } else {
+      for (uint64_t i = 0; i < length; i++)
+        write8(address + i, data[i]);
+    }
+    address += length;
+    data += length;
+    size -= length;
+  }
+}
+
+// Copy a block of bytes out of memory
+void memory::read_block(uint64_t address, uint8_t *data, uint64_t size) {
+  uint64_t page_size = 1ULL << page_bits;
+  while (size > 0) {
+    uint64_t offset = address & (page_size - 1);
+    uint64_t length = std::min(size, page_size - offset);
+    uint64_t *host = page(address, false);
+    if (host) {
+      memcpy(data, reinterpret_cast<uint8_t *>(host) + offset, length);
+    } else {
+      for (uint64_t i = 0; i < length; i++)
+        data[i] = read8(address + i);
+    }
+    address += length;
+    data += length;
+    size -= length;
+  }
+}
+
+// Zero a block of memory, skipping pages which have not been allocated
+void memory::clear_block(uint64_t address, uint64_t size) {
+  uint64_t page_size = 1ULL << page_bits;
+  while (size > 0) {
+    uint64_t offset = address & (page_size - 1);
+    uint64_t length = std::min(size, page_size - offset);
+    if (uint64_t *host = window_page(address)) {
+      window_written(address);
+      // Whole pages are dropped, and read as zero without host storage
+      if (length == page_size)
+        madvise(host, page_size, MADV_DONTNEED);
+      else
+        memset(reinterpret_cast<uint8_t *>(host) + offset, 0, length);
+    } else if (page_frame *frame = find_frame(address, false)) {
+      if (frame->device) {
+        for (uint64_t i = 0; i < length; i++)
+          write8(address + i, 0);
+      } else {
+        memset(reinterpret_cast<uint8_t *>(frame_data(frame, true)) + offset,
+               0, length);
+      }
+    }
+    address += length;
+    size -= length;
+  }
+}
+
+// Attach a device over the pages covering an address range
+void memory::add_device(device *target, uint64_t base, uint64_t size,
+                        uint64_t offset) {
+  this->devices.push_back({target, base, size, offset, 0});
+  unsigned int index = this->devices.size();
+  uint64_t page_size = 1ULL << page_bits;
+  uint64_t first = base & ~(page_size - 1);
+  for (uint64_t address = first; address - first < base + size - first;
+       address += page_size) {
+    find_frame(address, true)->device = index;
+    mark_window_frame(address >> page_bits);
+  }
+  invalidate_pages(base, size);
+  // Give the device its first tick before the next instruction
+  this->next_tick = 0;
+}
+
+void memory::add_invalidate_hook(invalidate_hook hook) {
+  this->invalidate_hooks.push_back(hook);
+}
+
+void memory::invalidate_pages(uint64_t address, uint64_t size) {
+  for (const invalidate_hook &hook : this->invalidate_hooks)
+    hook(address, size);
+}
+
+// Accesses to a device page outside the device's own range read as zero and
+// ignore writes
+uint64_t memory::device_read(unsigned int index, uint64_t address,
+                             uint64_t mask) {
+  const device_mapping &mapping = this->devices[index];
+  uint64_t offset = (address & ~0x7ULL) - mapping.base;
+  if (offset >= mapping.size)
+    return 0;
+  return mapping.target->read_doubleword(mapping.offset + offset, mask,
+                                         this->now);
+}
+
+void memory::device_write(unsigned int index, uint64_t address, uint64_t data,
+                          uint64_t mask) {
+  const device_mapping &mapping = this->devices[index];
+  uint64_t offset = (address & ~0x7ULL) - mapping.base;
+  if (offset < mapping.size)
+    mapping.target->write_doubleword(mapping.offset + offset, data, mask,
+                                     this->now);
 }
 
-// Load a hex image file and provide the start address for execution from the
-// file in start_address. Return true if the file was read without error, or
-// false otherwise.
+void memory::flush_devices() {
+  for (device_mapping &mapping : this->devices)
+    mapping.target->flush();
+}
+
+void memory::tick_devices() {
+  this->next_tick = device::never;
+  for (device_mapping &mapping : this->devices) {
+    if (this->now >= mapping.next_tick)
+      mapping.next_tick = mapping.target->tick(this->now);
+    if (mapping.next_tick < this->next_tick)
+      this->next_tick = mapping.next_tick;
+  }
+  if (this->now >= this->next_sweep) {
+    sweep();
+    this->next_sweep = this->now + this->sweep_interval;
+  }
+  if (this->next_sweep < this->next_tick)
+    this->next_tick = this->next_sweep;
+}
+
+// Load an ELF64 executable or a hex image file and provide the start address
+// for execution from the file in start_address. Return true if the file was
+// read without error, or false otherwise.
 bool memory::load_file(std::string file_name, uint64_t &start_address) {
-  std::ifstream input_file(file_name);
-  std::string input;
+  int fd = open(file_name.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cout << "Failed to open file" << std::endl;
+    return false;
+  }
+  char magic[SELFMAG];
+  bool elf = read(fd, magic, SELFMAG) == SELFMAG &&
+             memcmp(magic, ELFMAG, SELFMAG) == 0;
+  bool loaded = elf && load_elf(fd, start_address);
+  close(fd);
+  if (elf)
+    return loaded;
+
+  std::string cache_name = image_cache_name(file_name);
+  uint64_t byte_count;
+  if (this->use_image_cache &&
+      load_image_cache(cache_name, file_name, start_address, byte_count)) {
+    report_load(byte_count, start_address);
+    return true;
+  }
+
+  std::vector<image_segment> segments;
+  if (!parse_hex(file_name, segments, start_address, byte_count))
+    return false;
+  for (const image_segment &segment : segments)
+    store_segment(segment.address, segment.data.data(), segment.data.size());
+  if (this->use_image_cache)
+    write_image_cache(cache_name, segments, start_address, byte_count);
+  report_load(byte_count, start_address);
+  return true;
+}
+
+void memory::report_load(uint64_t byte_count, uint64_t start_address) {
+  std::cout << std::dec << byte_count
+            << " bytes loaded, start address = " << std::setw(16)
+            << std::setfill('0') << std::hex << start_address << std::endl;
+}
+
+// Copy loaded bytes into memory, extending the end of the image
+void memory::store_segment(uint64_t address, const uint8_t *data,
+                           uint64_t size) {
+  write_block(address, data, size);
+  if (size > 0 && address + size > this->image_end)
+    this->image_end = address + size;
+}
+
+// Value of each hex digit character, or 0xff for other characters
+static struct hex_digit_table {
+  uint8_t values[256];
+  hex_digit_table() {
+    memset(values, 0xff, sizeof(values));
+    for (unsigned int i = 0; i < 10; i++)
+      values['0' + i] = i;
+    for (unsigned int i = 0; i < 6; i++)
+      values['a' + i] = values['A' + i] = 10 + i;
+  }
+} hex_digits;
+
+// Parse a hex file into runs of contiguous bytes. The whole file is read at
+// once, and each record is decoded through a lookup table and checked against
+// its checksum before it is used.
+bool memory::parse_hex(std::string file_name,
+                       std::vector<image_segment> &segments,
+                       uint64_t &start_address, uint64_t &byte_count) {
+  std::ifstream input_file(file_name, std::ios::binary);
+  if (!input_file.is_open()) {
+    std::cout << "Failed to open file" << std::endl;
+    return false;
+  }
+  input_file.seekg(0, std::ios::end);
+  std::string text(input_file.tellg(), '\0');
+  input_file.seekg(0);
+  input_file.read(&text[0], text.size());
+  const char *p = text.data();
+  const char *end = p + text.size();
   unsigned int line_count = 0;
-  unsigned int byte_count = 0;
-  char record_start;
-  char byte_string[3];
-  char halfword_string[5];
-  unsigned int record_length;
-  unsigned int record_address;
-  unsigned int record_type;
-  unsigned int record_data;
-  unsigned int record_checksum;
-  bool end_of_file_record = false;
-  uint64_t load_address;
-  uint64_t load_data;
-  uint64_t load_mask;
   uint64_t load_base_address = 0x0000000000000000ULL;
+  uint64_t segment_end = 0;
+  uint8_t record[260];
   start_address = 0x0000000000000000ULL;
-  if (input_file.is_open()) {
-    while (true) {
-      line_count++;
-      input_file >> record_start;
-      if (record_start != ':') {
+  byte_count = 0;
+  segments.clear();
+  while (true) {
+    while (p < end && isspace(static_cast<unsigned char>(*p)))
+      p++;
+    if (p == end)
+      break; // No end of file record
+    line_count++;
+    if (*p++ != ':') {
+      std::cout << "Input line " << std::dec << line_count
+                << " does not start with colon character" << std::endl;
+      return false;
+    }
+    // Length, address (2), type, data and checksum bytes
+    size_t record_size = 5;
+    uint8_t checksum = 0;
+    const uint8_t *digits = hex_digits.values;
+    for (size_t i = 0; i < record_size; i++, p += 2) {
+      uint8_t high = end - p >= 2 ? digits[static_cast<uint8_t>(p[0])] : 0xff;
+      uint8_t low = end - p >= 2 ? digits[static_cast<uint8_t>(p[1])] : 0xff;
+      if ((high | low) & 0xf0) {
         std::cout << "Input line " << std::dec << line_count
-                  << " does not start with colon character" << std::endl;
+                  << " is not a valid record" << std::endl;
         return false;
       }
-      input_file.get(byte_string, 3);
-      sscanf(byte_string, "%x", &record_length);
-      input_file.get(halfword_string, 5);
-      sscanf(halfword_string, "%x", &record_address);
-      input_file.get(byte_string, 3);
-      sscanf(byte_string, "%x", &record_type);
-      switch (record_type) {
-      case 0x00: // Data record
-        for (unsigned int i = 0; i < record_length; i++) {
-          input_file.get(byte_string, 3);
-          sscanf(byte_string, "%x", &record_data);
-          load_address = (load_base_address | (uint64_t)(record_address)) + i;
-          load_data = (uint64_t)(record_data) << ((load_address % 8) * 8);
-          load_mask = 0x00000000000000ffULL << ((load_address % 8) * 8);
-          write_doubleword(load_address & 0xfffffffffffffff8ULL, load_data,
-                           load_mask);
-          byte_count++;
-        }
-        break;
-      case 0x01: // End of file
-        end_of_file_record = true;
-        break;
-      case 0x02: // Extended segment address (set bits 19:4 of load base
-                 // address)
-        load_base_address = 0x0000000000000000ULL;
-        for (unsigned int i = 0; i < record_length; i++) {
-          input_file.get(byte_string, 3);
-          sscanf(byte_string, "%x", &record_data);
-          load_base_address = (load_base_address << 8) | (record_data << 4);
-        }
-        break;
-      case 0x03: // Start segment address (ignored)
-        for (unsigned int i = 0; i < record_length; i++) {
-          input_file.get(byte_string, 3);
-          sscanf(byte_string, "%x", &record_data);
-        }
-        break;
-      case 0x04: // Extended linear address (set upper halfword of load base
-                 // address)
-        load_base_address = 0x0000000000000000ULL;
-        for (unsigned int i = 0; i < record_length; i++) {
-          input_file.get(byte_string, 3);
-          sscanf(byte_string, "%x", &record_data);
-          load_base_address = (load_base_address << 8) | (record_data << 16);
-        }
-        break;
-      case 0x05: // Start linear address (set execution start address)
-        start_address = 0x0000000000000000ULL;
-        for (unsigned int i = 0; i < record_length; i++) {
-          input_file.get(byte_string, 3);
-          sscanf(byte_string, "%x", &record_data);
-          start_address = (start_address << 8) | record_data;
-        }
-        break;
+      record[i] = (high << 4) | low;
+      checksum += record[i];
+      if (i == 0)
+        record_size += record[0];
+    }
+    if (checksum != 0) {
+      std::cout << "Input line " << std::dec << line_count
+                << " has an incorrect checksum" << std::endl;
+      return false;
+    }
+    unsigned int record_length = record[0];
+    unsigned int record_address = (record[1] << 8) | record[2];
+    const uint8_t *record_data = &record[4];
+    uint64_t value = 0;
+    for (unsigned int i = 0; i < record_length && i < 8; i++)
+      value = (value << 8) | record_data[i];
+    switch (record[3]) {
+    case 0x00: { // Data record
+      uint64_t load_address = load_base_address + record_address;
+      if (segments.empty() || load_address != segment_end)
+        segments.push_back({load_address, {}});
+      std::vector<uint8_t> &data = segments.back().data;
+      data.insert(data.end(), record_data, record_data + record_length);
+      segment_end = load_address + record_length;
+      byte_count += record_length;
+      break;
+    }
+    case 0x01: // End of file
+      return true;
+    case 0x02: // Extended segment address (set bits 19:4 of load base address)
+      load_base_address = value << 4;
+      break;
+    case 0x03: // Start segment address (ignored)
+      break;
+    case 0x04: // Extended linear address (set upper halfword of load base
+               // address)
+      load_base_address = value << 16;
+      break;
+    case 0x05: // Start linear address (set execution start address)
+      start_address = value;
+      break;
+    }
+  }
+  return true;
+}
+
+// The cache for image.hex is image.rvimg, in the same directory
+std::string memory::image_cache_name(std::string file_name) {
+  size_t dot = file_name.rfind('.');
+  size_t slash = file_name.rfind('/');
+  if (dot != std::string::npos && (slash == std::string::npos || dot > slash))
+    file_name.erase(dot);
+  return file_name + ".rvimg";
+}
+
+// Image cache layout, in little-endian doublewords: the magic number, the
+// start address, the byte count, the end of the image, page_bits, the number
+// of pages and the number of ranges, followed by the page number of each page
+// and the address and size of each range of bytes loaded, in address order.
+// Page contents follow from the next page boundary, so each can be mapped in
+// place.
+static constexpr uint64_t image_cache_magic = 0x33474d4956520a00ULL;
+static constexpr size_t image_cache_header = 7;
+
+bool memory::load_image_cache(std::string cache_name, std::string file_name,
+                              uint64_t &start_address, uint64_t &byte_count) {
+  struct stat cache_status, file_status;
+  if (stat(cache_name.c_str(), &cache_status) != 0 ||
+      stat(file_name.c_str(), &file_status) != 0 ||
+      cache_status.st_mtime < file_status.st_mtime)
+    return false;
+  int fd = open(cache_name.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  // Writes to a private mapping copy the page, leaving the file and other
+  // simulators mapping it untouched
+  size_t size = cache_status.st_size;
+  void *mapping = size >= image_cache_header * 8
+                      ? mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE, fd, 0)
+                      : MAP_FAILED;
+  close(fd);
+  if (mapping == MAP_FAILED)
+    return false;
+  uint64_t page_size = 1ULL << page_bits;
+  const uint64_t *words = static_cast<const uint64_t *>(mapping);
+  uint64_t count = words[5];
+  uint64_t range_count = words[6];
+  uint64_t first_page = (image_cache_header + count + range_count * 2) * 8;
+  first_page = (first_page + page_size - 1) & ~(page_size - 1);
+  if (words[0] != image_cache_magic || words[4] != page_bits ||
+      count >= size / page_size || range_count >= size / 16 ||
+      first_page + count * page_size != size) {
+    munmap(mapping, size);
+    return false;
+  }
+  start_address = words[1];
+  byte_count = words[2];
+  this->image_end = std::max(this->image_end, words[3]);
+  this->image_mappings.push_back({mapping, size});
+  map_pages(words + image_cache_header,
+            static_cast<uint8_t *>(mapping) + first_page, count,
+            words + image_cache_header + count, range_count);
+  return true;
+}
+
+// Use consecutive pages of a mapped image as the storage of the guest pages
+// with the given page numbers, which are in ascending order. If ranges is not
+// nullptr, only the bytes in its address and size pairs were loaded, and
+// pages already in use keep their other bytes.
+void memory::map_pages(const uint64_t *keys, uint8_t *pages, uint64_t count,
+                       const uint64_t *ranges, uint64_t range_count) {
+  uint64_t page_size = 1ULL << page_bits;
+  uint64_t range = 0;
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t address = keys[i] << page_bits;
+    uint8_t *data = pages + i * page_size;
+    page_frame *frame = window_page(address) ? nullptr
+                                             : find_frame(address, true);
+    if (frame && !frame->device && !frame->data && !frame->compressed) {
+      frame->data = reinterpret_cast<uint64_t *>(data);
+      page_written(frame->key, frame->generation);
+      ++this->image_page_count;
+      if (this->zero_page_shared)
+        invalidate_pages(address, page_size);
+    } else if (!ranges) {
+      // Pages already in use, and window pages, take a copy of the whole page
+      write_block(address, data, page_size);
+    } else {
+      // or of the ranges of the page which were loaded
+      while (range < range_count &&
+             ranges[range * 2] + ranges[range * 2 + 1] <= address)
+        range++;
+      for (uint64_t j = range;
+           j < range_count && ranges[j * 2] < address + page_size; j++) {
+        uint64_t start = std::max(ranges[j * 2], address);
+        uint64_t end =
+            std::min(ranges[j * 2] + ranges[j * 2 + 1], address + page_size);
+        write_block(start, data + (start - address), end - start);
       }
-      input_file.get(byte_string, 3);
-      sscanf(byte_string, "%x", &record_checksum);
-      input_file.ignore();
-      if (end_of_file_record)
-        break;
-    }
-    input_file.close();
-    std::cout << std::dec << byte_count
-              << " bytes loaded, start address = " << std::setw(16)
-              << std::setfill('0') << std::hex << start_address << std::endl;
-    return true;
-  } else {
-    std::cout << "Failed to open file" << std::endl;
+    }
+  }
+}
+
+// The cache is written to a temporary file and renamed, so simulators loading
+// the same image at once never map a partly written cache
+void memory::write_image_cache(std::string cache_name,
+                               const std::vector<image_segment> &segments,
+                               uint64_t start_address, uint64_t byte_count) {
+  uint64_t page_size = 1ULL << page_bits;
+  std::map<uint64_t, std::vector<uint8_t>> pages;
+  std::map<uint64_t, uint64_t> ranges;
+  uint64_t end = 0;
+  for (const image_segment &segment : segments) {
+    uint64_t size = segment.data.size();
+    if (size > 0) {
+      uint64_t &range_end = ranges[segment.address];
+      range_end = std::max(range_end, segment.address + size);
+    }
+    for (uint64_t done = 0; done < size;) {
+      uint64_t address = segment.address + done;
+      uint64_t offset = address & (page_size - 1);
+      uint64_t length = std::min(size - done, page_size - offset);
+      std::vector<uint8_t> &page = pages[address >> page_bits];
+      page.resize(page_size);
+      memcpy(page.data() + offset, segment.data.data() + done, length);
+      done += length;
+    }
+    if (size > 0)
+      end = std::max(end, segment.address + size);
+  }
+  std::string temporary_name =
+      cache_name + "." + std::to_string(getpid()) + ".tmp";
+  std::ofstream cache_file(temporary_name, std::ios::binary | std::ios::trunc);
+  // Overlapping and adjacent ranges are merged
+  std::vector<uint64_t> merged;
+  for (const auto &range : ranges) {
+    if (!merged.empty() &&
+        range.first <= merged[merged.size() - 2] + merged.back()) {
+      uint64_t start = merged[merged.size() - 2];
+      merged.back() = std::max(merged.back(), range.second - start);
+    } else {
+      merged.push_back(range.first);
+      merged.push_back(range.second - range.first);
+    }
+  }
+  std::vector<uint64_t> header = {image_cache_magic, start_address,
+                                  byte_count,        end,
+                                  page_bits,         pages.size(),
+                                  merged.size() / 2};
+  for (const auto &page : pages)
+    header.push_back(page.first);
+  header.insert(header.end(), merged.begin(), merged.end());
+  header.resize(((header.size() * 8 + page_size - 1) & ~(page_size - 1)) / 8);
+  cache_file.write(reinterpret_cast<const char *>(header.data()),
+                   header.size() * 8);
+  for (const auto &page : pages)
+    cache_file.write(reinterpret_cast<const char *>(page.second.data()),
+                     page_size);
+  cache_file.close();
+  if (!cache_file || rename(temporary_name.c_str(), cache_name.c_str()) != 0) {
+    std::cout << "Failed to write image cache" << std::endl;
+    unlink(temporary_name.c_str());
+  }
+}
+
+// Snapshot layout, in little-endian doublewords: the magic number, page_bits,
+// the number of pages, the number of state doublewords, the chain and the
+// sequence number, followed by the state and the page number of each page.
+// Page contents follow from the next page boundary, as for image caches.
+//
+// A full snapshot has sequence number 0. If its chain is not 0, the snapshots
+// named after it with .1, .2 and so on in the same chain hold the pages
+// written since the one before.
+static constexpr uint64_t snapshot_magic = 0x32504e5356520a00ULL;
+static constexpr size_t snapshot_header = 6;
+
+// Write a snapshot to a temporary file which is then renamed, so that a partly
+// written snapshot is never seen. The contents of the page with each key come
+// from page_data.
+static bool write_snapshot_file(
+    std::string file_name, uint64_t chain, uint64_t sequence,
+    const std::vector<uint64_t> &state, const std::vector<uint64_t> &keys,
+    std::function<const uint8_t *(size_t index)> page_data) {
+  uint64_t page_size = 1ULL << memory::page_bits;
+  std::string temporary_name =
+      file_name + "." + std::to_string(getpid()) + ".tmp";
+  std::ofstream file(temporary_name, std::ios::binary | std::ios::trunc);
+  std::vector<uint64_t> header = {snapshot_magic, memory::page_bits,
+                                  keys.size(),    state.size(),
+                                  chain,          sequence};
+  header.insert(header.end(), state.begin(), state.end());
+  header.insert(header.end(), keys.begin(), keys.end());
+  header.resize(((header.size() * 8 + page_size - 1) & ~(page_size - 1)) / 8);
+  file.write(reinterpret_cast<const char *>(header.data()), header.size() * 8);
+  for (size_t i = 0; i < keys.size(); i++)
+    file.write(reinterpret_cast<const char *>(page_data(i)), page_size);
+  file.close();
+  if (!file || rename(temporary_name.c_str(), file_name.c_str()) != 0) {
+    unlink(temporary_name.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Map a snapshot privately, and check it holds state_size doublewords of
+// state. Returns the mapping and the offset of its first page, or nullptr.
+static const uint64_t *map_snapshot_file(std::string file_name,
+                                         size_t state_size, size_t &size,
+                                         uint64_t &first_page) {
+  int fd = open(file_name.c_str(), O_RDONLY);
+  if (fd < 0)
+    return nullptr;
+  struct stat file_status;
+  void *mapping = MAP_FAILED;
+  size = 0;
+  if (fstat(fd, &file_status) == 0 &&
+      static_cast<size_t>(file_status.st_size) >= snapshot_header * 8) {
+    size = file_status.st_size;
+    mapping =
+        mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (mapping == MAP_FAILED)
+    return nullptr;
+  uint64_t page_size = 1ULL << memory::page_bits;
+  const uint64_t *words = static_cast<const uint64_t *>(mapping);
+  uint64_t count = words[2];
+  first_page = (snapshot_header + state_size + count) * 8;
+  first_page = (first_page + page_size - 1) & ~(page_size - 1);
+  if (words[0] != snapshot_magic || words[1] != memory::page_bits ||
+      words[3] != state_size || count >= size / page_size ||
+      first_page + count * page_size != size) {
+    munmap(mapping, size);
+    return nullptr;
+  }
+  return words;
+}
+
+// RAM pages which are not all zeros are saved. Device pages are left out.
+bool memory::save_snapshot(std::string file_name,
+                           const std::vector<uint64_t> &state,
+                           uint64_t chain) {
+  std::vector<uint64_t> keys;
+  stored_pages(keys);
+  return write_snapshot_file(
+      file_name, chain, 0, state, keys,
+      [&](size_t index) { return page_contents(keys[index]); });
+}
+
+bool memory::write_snapshot(std::string file_name, uint64_t chain,
+                            uint64_t sequence,
+                            const std::vector<uint64_t> &state,
+                            const std::vector<uint64_t> &keys,
+                            const std::vector<uint8_t> &contents) {
+  return write_snapshot_file(
+      file_name, chain, sequence, state, keys, [&](size_t index) {
+        return contents.data() + (index << page_bits);
+      });
+}
+
+// The full snapshot is mapped privately, so its pages are only copied when
+// they are written, and the file is never changed. Pages of the snapshots
+// chained to it are copied, as they are few.
+bool memory::restore_snapshot(std::string file_name,
+                              std::vector<uint64_t> &state,
+                              size_t state_size) {
+  size_t size;
+  uint64_t first_page;
+  const uint64_t *words =
+      map_snapshot_file(file_name, state_size, size, first_page);
+  if (words == nullptr)
     return false;
+  if (words[5] != 0) {
+    munmap(const_cast<uint64_t *>(words), size);
+    return false;
+  }
+  uint64_t chain = words[4];
+  state.assign(words + snapshot_header, words + snapshot_header + state_size);
+  release_pages();
+  this->image_mappings.push_back({const_cast<uint64_t *>(words), size});
+  map_pages(words + snapshot_header + state_size,
+            reinterpret_cast<uint8_t *>(const_cast<uint64_t *>(words)) +
+                first_page,
+            words[2]);
+
+  uint64_t page_size = 1ULL << page_bits;
+  for (uint64_t sequence = 1; chain != 0; sequence++) {
+    words = map_snapshot_file(file_name + "." + std::to_string(sequence),
+                              state_size, size, first_page);
+    if (words == nullptr)
+      break;
+    bool chained = words[4] == chain && words[5] == sequence;
+    if (chained) {
+      state.assign(words + snapshot_header,
+                   words + snapshot_header + state_size);
+      const uint64_t *keys = words + snapshot_header + state_size;
+      const uint8_t *pages =
+          reinterpret_cast<const uint8_t *>(words) + first_page;
+      for (uint64_t i = 0; i < words[2]; i++)
+        write_block(keys[i] << page_bits, pages + i * page_size, page_size);
+    }
+    munmap(const_cast<uint64_t *>(words), size);
+    if (!chained)
+      break;
+  }
+  return true;
+}
+
+// Drop the contents of every RAM page, leaving all memory zero. Mapped images
+// are no longer used by any page, so they are unmapped.
+void memory::release_pages() {
+  invalidate_pages(0, ~0ULL);
+  for (page_frame *frame : this->all_frames) {
+    if (frame->compressed) {
+      delete[] frame->compressed;
+      frame->compressed = nullptr;
+      this->compressed_bytes -= frame->compressed_size;
+      --this->compressed_count;
+    }
+    if (frame->data)
+      release_data(frame);
+  }
+  if (this->window)
+    madvise(this->window, this->window_size, MADV_DONTNEED);
+  for (const auto &mapping : this->image_mappings)
+    munmap(mapping.first, mapping.second);
+  this->image_mappings.clear();
+  this->image_page_count = 0;
+  this->replaced_generation = this->generation;
+}
+
+// Writes to the window were not logged before, so the log only covers the
+// new generation on
+uint64_t memory::track_dirty_pages() {
+  if (this->window && this->window_generations.empty()) {
+    this->window_generations.resize(this->window_size >> page_bits);
+    this->log_start = this->generation + 1;
+  }
+  return start_dirty_generation();
+}
+
+// Cached pointers are dropped, so that every page is looked up again before it
+// is written and marked with the new generation
+uint64_t memory::start_dirty_generation() {
+  invalidate_pages(0, ~0ULL);
+  return ++this->generation;
+}
+
+void memory::dirty_pages(uint64_t since, std::vector<uint64_t> &keys) {
+  keys.clear();
+  if (since >= this->log_start) {
+    auto first = std::lower_bound(
+        this->dirty_log.begin(), this->dirty_log.end(),
+        std::make_pair(since, static_cast<uint64_t>(0)));
+    for (auto entry = first; entry != this->dirty_log.end(); ++entry)
+      keys.push_back(entry->second);
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    return;
+  }
+  for (page_frame *frame : this->all_frames) {
+    if (!frame->device && frame->generation >= since)
+      keys.push_back(frame->key);
+  }
+  for (size_t i = 0; i < this->window_generations.size(); i++) {
+    if (this->window_generations[i] >= since)
+      keys.push_back(i);
+  }
+  std::sort(keys.begin(), keys.end());
+}
+
+bool memory::replaced_since(uint64_t since) {
+  return this->replaced_generation >= since;
+}
+
+// Compressed pages and pages of the window the host has backed are included
+void memory::stored_pages(std::vector<uint64_t> &keys) {
+  uint64_t page_size = 1ULL << page_bits;
+  auto is_zero = [](const uint64_t *data) {
+    return std::all_of(data, data + page_words,
+                       [](uint64_t word) { return word == 0; });
+  };
+  keys.clear();
+  for (page_frame *frame : this->all_frames) {
+    if (!frame->device && (frame->compressed ||
+                           (frame->data && !is_zero(frame->data))))
+      keys.push_back(frame->key);
+  }
+  if (this->window) {
+    uint64_t host_page_size = sysconf(_SC_PAGESIZE);
+    std::vector<unsigned char> resident(
+        (this->window_size + host_page_size - 1) / host_page_size);
+    if (mincore(this->window, this->window_size, resident.data()) != 0)
+      std::fill(resident.begin(), resident.end(), 1);
+    for (uint64_t address = 0; address < this->window_size;
+         address += page_size) {
+      uint64_t first = address / host_page_size;
+      uint64_t last = (address + page_size - 1) / host_page_size;
+      bool backed = false;
+      for (uint64_t i = first; i <= last; i++)
+        backed |= resident[i] & 1;
+      uint64_t *host = window_page(address);
+      if (backed && host && !is_zero(host))
+        keys.push_back(address >> page_bits);
+    }
+  }
+  std::sort(keys.begin(), keys.end());
+}
+
+void memory::copy_pages(const std::vector<uint64_t> &keys,
+                        std::vector<uint8_t> &contents) {
+  uint64_t page_size = 1ULL << page_bits;
+  contents.resize(keys.size() << page_bits);
+  for (size_t i = 0; i < keys.size(); i++)
+    memcpy(contents.data() + (i << page_bits), page_contents(keys[i]),
+           page_size);
+}
+
+// Contents of a page without changing how it is stored. Compressed pages are
+// decompressed into a buffer which is reused by the next call.
+const uint8_t *memory::page_contents(uint64_t key) {
+  uint64_t address = key << page_bits;
+  if (uint64_t *host = window_page(address))
+    return reinterpret_cast<const uint8_t *>(host);
+  page_frame *frame = find_frame(address, false);
+  if (frame && !frame->device && frame->compressed) {
+    page_codec::decompress(frame->compressed, frame->compressed_size,
+                           this->compress_buffer.data(), 1ULL << page_bits);
+    return this->compress_buffer.data();
+  }
+  if (frame && !frame->device && frame->data)
+    return reinterpret_cast<const uint8_t *>(frame->data);
+  return reinterpret_cast<const uint8_t *>(this->zero_page);
+}
+
+// Record a write to a page for dirty page tracking. Each page is logged once
+// per generation, so the log only outgrows twice the number of pages when
+// it holds old generations, which are dropped.
+void memory::page_written(uint64_t key, uint64_t &page_generation) {
+  if (page_generation == this->generation)
+    return;
+  page_generation = this->generation;
+  this->dirty_log.emplace_back(this->generation, key);
+  size_t limit = std::max<size_t>(
+      1024, 2 * (this->all_frames.size() + this->window_generations.size()));
+  if (this->dirty_log.size() > limit) {
+    auto current = std::lower_bound(
+        this->dirty_log.begin(), this->dirty_log.end(),
+        std::make_pair(this->generation, static_cast<uint64_t>(0)));
+    this->dirty_log.erase(this->dirty_log.begin(), current);
+    this->log_start = this->generation;
+  }
+}
+
+void memory::window_written(uint64_t address) {
+  if (!this->window_generations.empty())
+    page_written(address >> page_bits,
+                 this->window_generations[address >> page_bits]);
+}
+
+// Load a RISC-V ELF64 executable. The file is mapped, and each PT_LOAD segment
+// is copied to its physical address a page at a time. The rest of the segment
+// (.bss) is zeroed lazily, as pages not yet allocated are zero when first used.
+bool memory::load_elf(int fd, uint64_t &start_address) {
+  struct stat file_status;
+  if (fstat(fd, &file_status) != 0 ||
+      static_cast<size_t>(file_status.st_size) < sizeof(Elf64_Ehdr)) {
+    std::cout << "Invalid ELF file" << std::endl;
+    return false;
+  }
+  size_t file_size = file_status.st_size;
+  void *mapping = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (mapping == MAP_FAILED) {
+    std::cout << "Failed to map ELF file" << std::endl;
+    return false;
+  }
+  const uint8_t *image = static_cast<const uint8_t *>(mapping);
+  const Elf64_Ehdr *header = reinterpret_cast<const Elf64_Ehdr *>(image);
+  bool valid = header->e_ident[EI_CLASS] == ELFCLASS64 &&
+               header->e_ident[EI_DATA] == ELFDATA2LSB &&
+               header->e_machine == EM_RISCV &&
+               header->e_phentsize == sizeof(Elf64_Phdr) &&
+               header->e_phoff <= file_size &&
+               header->e_phnum <= (file_size - header->e_phoff) / sizeof(Elf64_Phdr);
+  auto program_header = [image, header](unsigned int i) {
+    return reinterpret_cast<const Elf64_Phdr *>(
+        image + header->e_phoff + i * sizeof(Elf64_Phdr));
+  };
+  // Every segment is checked before any is copied, so that an invalid file
+  // leaves memory as it was
+  for (unsigned int i = 0; valid && i < header->e_phnum; i++) {
+    const Elf64_Phdr *segment = program_header(i);
+    if (segment->p_type == PT_LOAD &&
+        (segment->p_offset > file_size ||
+         segment->p_filesz > file_size - segment->p_offset ||
+         segment->p_filesz > segment->p_memsz))
+      valid = false;
+  }
+  if (!valid) {
+    munmap(mapping, file_size);
+    std::cout << "Invalid ELF file" << std::endl;
+    return false;
+  }
+  uint64_t byte_count = 0;
+  for (unsigned int i = 0; i < header->e_phnum; i++) {
+    const Elf64_Phdr *segment = program_header(i);
+    if (segment->p_type != PT_LOAD)
+      continue;
+    store_segment(segment->p_paddr, image + segment->p_offset,
+                  segment->p_filesz);
+    clear_block(segment->p_paddr + segment->p_filesz,
+                segment->p_memsz - segment->p_filesz);
+    byte_count += segment->p_filesz;
+    if (segment->p_memsz > 0 &&
+        segment->p_paddr + segment->p_memsz > this->image_end)
+      this->image_end = segment->p_paddr + segment->p_memsz;
+  }
+  start_address = header->e_entry;
+  munmap(mapping, file_size);
+  report_load(byte_count, start_address);
+  return true;
+}
+
+void memory::show_statistics() {
+  std::cout << "Memory pages allocated: " << std::dec << this->page_count
+            << std::endl;
+  if (this->pages.huge_pages()) {
+    std::cout << "Huge pages obtained: " << this->pages.huge_page_count()
+              << " of " << this->pages.region_count() << std::endl;
+  }
+  if (this->image_page_count) {
+    std::cout << "Image pages mapped: " << this->image_page_count
+              << std::endl;
+  }
+  if (this->compress_after || this->limit) {
+    std::cout << "Memory pages compressed: " << this->compressed_count << " ("
+              << this->compressed_bytes << " bytes)" << std::endl;
+  }
+  if (this->deduplicate) {
+    uint64_t sharing = 0;
+    for (const auto &shared : this->shared_pages)
+      sharing += shared.second;
+    std::cout << "Memory pages shared: " << sharing << std::endl;
   }
 }
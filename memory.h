@@ -10,21 +10,252 @@
 **************************************************************** */
 
 #include <array>
+#include <cstddef>
 #include <cstdint>
+#include <functional>
+#include <stdexcept>
 #include <string>
 #include <unordered_map>
+#include <vector>
+
+#include "device.h"
+
+// Size of each page of store, as a power of two: 12 for 4 Kbyte pages or 16
+// for 64 Kbyte pages
+#ifndef MEMORY_PAGE_BITS
+#define MEMORY_PAGE_BITS 12
+#endif
 
 class memory {
 
+public:
+  static constexpr unsigned int page_bits = MEMORY_PAGE_BITS;
+  static constexpr uint64_t page_words = 1ULL << (page_bits - 3);
+  typedef std::function<void(uint64_t address, uint64_t size)> invalidate_hook;
+
+  // Thrown when a page can not be allocated within the guest memory limit
+  class limit_exceeded : public std::runtime_error {
+  public:
+    limit_exceeded() : std::runtime_error("Guest memory limit exceeded") {}
+  };
+
 private:
-  std::unordered_map<uint64_t, std::array<uint64_t, 256>> store;
-  static constexpr uint64_t address_index(uint64_t address) {
-    return (address >> 3) & 0xFF;
-  }
-  static constexpr uint64_t address_key(uint64_t address) {
-    return (address >> 3) & (~0xFF);
+  struct page_frame {
+    // Host storage, or nullptr if the page is all zeros or compressed
+    uint64_t *data;
+    // Compressed contents, or nullptr
+    uint8_t *compressed;
+    uint32_t compressed_size;
+    // Index of the device mapping the page plus 1, or 0 for RAM
+    unsigned int device;
+    // Page number, the address shifted right by page_bits
+    uint64_t key;
+    // Tick of the last lookup of the page's storage
+    uint64_t last_used;
+    // Generation of dirty page tracking in which the page was last written
+    uint64_t generation;
+    // The storage may be shared with identical pages, and is copied before
+    // it is written
+    bool shared;
+  };
+
+  // Pages are found through a radix tree indexed by page number, radix_bits
+  // at a time. A slot leads straight to a page when no other page shares the
+  // rest of its path, and each node records the key bits above it, so pages
+  // scattered across the address space need few nodes. Slots hold a node
+  // pointer, a page frame pointer with bit 0 set, or 0 if empty.
+  static constexpr unsigned int radix_bits = 8;
+  static constexpr unsigned int radix_size = 1 << radix_bits;
+  // The root indexes the highest bits of the page number
+  static constexpr unsigned int root_shift =
+      (64 - page_bits - 1) / radix_bits * radix_bits;
+
+  struct radix_node {
+    // Bits of every key below the node above those it indexes
+    uint64_t prefix;
+    unsigned int shift;
+    std::array<uintptr_t, radix_size> slots;
+  };
+
+  // Page frames and radix nodes are carved from large zeroed chunks, and are
+  // only freed with the memory object. Page storage is held separately so
+  // that it can be freed.
+  class arena {
+  public:
+    arena();
+    ~arena();
+    void *allocate(size_t size);
+
+  private:
+    std::vector<void *> chunks;
+    uint8_t *next;
+    size_t remaining;
+  };
+
+  // Page storage is carved from large anonymous mappings. Freed pages are
+  // returned to the host with madvise, so they are zero when reused.
+  //
+  // With huge pages, each aligned region of guest memory the size of a host
+  // huge page is given a region of the mappings, which are marked with
+  // madvise(MADV_HUGEPAGE), and its pages are held at the same offsets. Dense
+  // guest memory is then backed by host huge pages. Freed pages are zeroed in
+  // place instead, as returning them would split the huge page.
+  class page_pool {
+  public:
+    static constexpr unsigned int huge_page_bits = 21;
+
+    page_pool();
+    ~page_pool();
+    void set_huge_pages(bool enabled) { this->huge = enabled; }
+    bool huge_pages() const { return this->huge; }
+    uint64_t *allocate(uint64_t key);
+    void free(uint64_t *page);
+    // Bytes of host memory held once the page for a key is allocated, with a
+    // number of pages allocated. Each region holds a whole huge page.
+    uint64_t held_after(uint64_t key, uint64_t page_count) const;
+    // Regions given out, and how many the host backs with huge pages
+    uint64_t region_count() const { return this->regions.size(); }
+    uint64_t huge_page_count() const;
+
+  private:
+    bool huge;
+    std::vector<std::pair<void *, size_t>> chunks;
+    std::vector<uint64_t *> free_pages;
+    std::unordered_map<uint64_t, uint8_t *> regions;
+    uint8_t *next;
+    size_t remaining;
+    uint8_t *allocate_chunk_space(size_t size);
+  };
+
+  arena frames;
+  radix_node root;
+  page_pool pages;
+  std::vector<page_frame *> all_frames;
+  // Pages of storage held, and bytes of compressed pages
+  uint64_t page_count;
+  uint64_t compressed_count;
+  uint64_t compressed_bytes;
+
+  // Storage shared by identical pages, and the number of pages sharing it
+  std::unordered_map<uint64_t *, unsigned int> shared_pages;
+
+  // Limit on bytes of storage and compressed pages, or 0 for none
+  uint64_t limit;
+  // Pages unused for this many ticks are compressed, or 0 for never
+  uint64_t compress_after;
+  bool deduplicate;
+  // Ticks between sweeps for compression and deduplication, and the next
+  uint64_t sweep_interval;
+  uint64_t next_sweep;
+  std::vector<uint8_t> compress_buffer;
+
+  uint64_t *frame_data(page_frame *frame, bool write);
+  uint64_t *allocate_page(uint64_t key);
+  void release_data(page_frame *frame);
+  bool compress_frame(page_frame *frame);
+  void merge_pages();
+  void reclaim();
+  void sweep();
+
+  // Optional flat window of guest memory from address 0, reserved without
+  // backing so untouched pages cost nothing. Guest addresses in the window map
+  // to host addresses with a single add. Device pages in the window are held
+  // in the radix tree instead, as are all addresses outside it. A bit is set
+  // for each page of the window held in the tree, so that the tree is only
+  // searched for those.
+  uint8_t *window;
+  uint64_t window_size;
+  std::vector<uint64_t> window_framed;
+  void mark_window_frame(uint64_t key);
+  uint64_t *window_page(uint64_t address) {
+    uint64_t key = address >> page_bits;
+    if (address >= this->window_size ||
+        ((this->window_framed[key >> 6] >> (key & 63)) & 1))
+      return nullptr;
+    return reinterpret_cast<uint64_t *>(this->window + (key << page_bits));
   }
-  void validate_address(uint64_t address);
+
+  // Find the page containing an address, allocating it if requested, or
+  // return nullptr
+  page_frame *find_frame(uint64_t address, bool allocate);
+
+  struct device_mapping {
+    device *target;
+    uint64_t base;
+    uint64_t size;
+    uint64_t offset;
+    uint64_t next_tick;
+  };
+
+  std::vector<device_mapping> devices;
+  std::vector<invalidate_hook> invalidate_hooks;
+  void invalidate_pages(uint64_t address, uint64_t size);
+
+  template <typename T> T read_value(uint64_t address);
+  template <typename T> void write_value(uint64_t address, T value);
+
+  // Read-only page of zeros shared by every page which has been read but never
+  // written, and whether it has been handed out by page()
+  uint64_t *zero_page;
+  bool zero_page_shared;
+
+  // End of the highest address loaded from an image file
+  uint64_t image_end;
+
+  // Tick count passed to devices, and the earliest tick a device asked for or
+  // a sweep is due
+  uint64_t now;
+  uint64_t next_tick;
+
+  uint64_t device_read(unsigned int index, uint64_t address, uint64_t mask);
+  void device_write(unsigned int index, uint64_t address, uint64_t data,
+                    uint64_t mask);
+  void tick_devices();
+
+  // A run of contiguous bytes read from a hex file
+  struct image_segment {
+    uint64_t address;
+    std::vector<uint8_t> data;
+  };
+
+  // Write and use binary caches of hex files
+  bool use_image_cache;
+  // Mappings of image caches holding page storage, and the pages they hold
+  std::vector<std::pair<void *, size_t>> image_mappings;
+  uint64_t image_page_count;
+  bool image_page(const uint64_t *data);
+  void map_pages(const uint64_t *keys, uint8_t *pages, uint64_t count,
+                 const uint64_t *ranges = nullptr, uint64_t range_count = 0);
+  void release_pages();
+
+  // Dirty page tracking. Each page records the generation in which it was
+  // last written, as does each entry for a page of the window. Every page has
+  // changed since the generation in which memory was replaced by a snapshot.
+  uint64_t generation;
+  std::vector<uint64_t> window_generations;
+  uint64_t replaced_generation;
+  // The first write to a page in each generation is also logged, as the
+  // generation and the page number, so that the pages written since a recent
+  // generation are found without scanning every page. The log holds every
+  // write from log_start on, and older entries are dropped once it outgrows
+  // the pages.
+  std::vector<std::pair<uint64_t, uint64_t>> dirty_log;
+  uint64_t log_start;
+  void page_written(uint64_t key, uint64_t &page_generation);
+  void window_written(uint64_t address);
+  const uint8_t *page_contents(uint64_t key);
+
+  bool load_elf(int fd, uint64_t &start_address);
+  bool parse_hex(std::string file_name, std::vector<image_segment> &segments,
+                 uint64_t &start_address, uint64_t &byte_count);
+  static std::string image_cache_name(std::string file_name);
+  bool load_image_cache(std::string cache_name, std::string file_name,
+                        uint64_t &start_address, uint64_t &byte_count);
+  void write_image_cache(std::string cache_name,
+                         const std::vector<image_segment> &segments,
+                         uint64_t start_address, uint64_t byte_count);
+  void store_segment(uint64_t address, const uint8_t *data, uint64_t size);
+  void report_load(uint64_t byte_count, uint64_t start_address);
 
   const bool verbose;
 
@@ -37,13 +268,25 @@ private:
   //   void validate (uint64_t address);
 
 public:
+  // Index of the doubleword containing an address within its page
+  static constexpr uint64_t address_index(uint64_t address) {
+    return (address >> 3) & (page_words - 1);
+  }
+
   // Constructor
   memory(bool verbose);
+  ~memory();
+
+  // Reserve a flat window of guest memory from address 0 to size, rounded up
+  // to a whole page. Return false if the host could not reserve it.
+  bool map_window(uint64_t size);
 
   // Read a doubleword of data from a doubleword-aligned address.
   // If the address is not a multiple of 8, it is rounded down to a multiple
-  // of 8.
-  uint64_t read_doubleword(uint64_t address);
+  // of 8. The mask contains 1s for the bytes being read, which only matters
+  // for device registers.
+  uint64_t read_doubleword(uint64_t address,
+                           uint64_t mask = 0xffffffffffffffffULL);
 
   // Write a doubleword of data to a doubleword-aligned address.
   // If the address is not a multiple of 8, it is rounded down to a multiple
@@ -51,10 +294,135 @@ public:
   // are to be unchanged.
   void write_doubleword(uint64_t address, uint64_t data, uint64_t mask);
 
-  // Load a hex image file and provide the start address for execution from the
-  // file in start_address. Return true if the file was read without error, or
-  // false otherwise.
+  // Read or write a naturally aligned value of 1, 2, 4 or 8 bytes directly in
+  // its page. Device pages are accessed through a masked doubleword.
+  uint8_t read8(uint64_t address);
+  uint16_t read16(uint64_t address);
+  uint32_t read32(uint64_t address);
+  uint64_t read64(uint64_t address);
+  void write8(uint64_t address, uint8_t value);
+  void write16(uint64_t address, uint16_t value);
+  void write32(uint64_t address, uint32_t value);
+  void write64(uint64_t address, uint64_t value);
+
+  // Return the host storage for the page containing an address. Unless write
+  // is set the storage may be shared, such as the zero page for pages which
+  // have never been written, and must only be read. The pointer remains valid
+  // until the invalidate hooks are called for the page. Returns nullptr for
+  // device pages, which must be accessed through read_doubleword and
+  // write_doubleword.
+  uint64_t *page(uint64_t address, bool write);
+
+  // Limit the host memory used for guest pages to a number of bytes. When a
+  // page can not be allocated after compressing the least recently used
+  // pages, limit_exceeded is thrown. The flat window is not counted.
+  void set_limit(uint64_t bytes) { this->limit = bytes; }
+
+  // Compress pages which have not been used for a number of ticks, and share
+  // the storage of identical pages until they are written. Both are done by
+  // periodic sweeps from tick().
+  void set_compression(uint64_t idle_ticks);
+  void set_deduplication(bool enabled);
+
+  // Back dense guest memory with host transparent huge pages. Every page
+  // touched in sparse guest memory takes a whole huge page.
+  void set_huge_pages(bool enabled) { this->pages.set_huge_pages(enabled); }
+
+  // Add a hook called whenever pages returned by page() may be moved, unmapped
+  // or write protected, or a shared zero page is replaced, so that cached host
+  // pointers to the address range can be dropped
+  void add_invalidate_hook(invalidate_hook hook);
+
+  // Copy a block of bytes into or out of memory a page at a time, as for DMA
+  // transfers. Device pages are accessed a byte at a time.
+  void write_block(uint64_t address, const uint8_t *data, uint64_t size);
+  void read_block(uint64_t address, uint8_t *data, uint64_t size);
+
+  // Zero a block of memory. Pages which have not been allocated are left
+  // alone, as they are zero when first used.
+  void clear_block(uint64_t address, uint64_t size);
+
+  // Attach a device over the pages covering an address range. We do not take
+  // ownership of the device. A sparse device can be attached as several
+  // ranges, each giving its offset within the device.
+  void add_device(device *target, uint64_t base, uint64_t size,
+                  uint64_t offset = 0);
+
+  // Write out buffered device output
+  void flush_devices();
+
+  // Advance the tick count seen by devices, calling device tick hooks and
+  // memory sweeps once they are due
+  void tick(uint64_t now) {
+    this->now = now;
+    if (now >= this->next_tick)
+      tick_devices();
+  }
+
+  // Load an ELF64 executable or a hex image file and provide the start address
+  // for execution from the file in start_address. Return true if the file was
+  // read without error, or false otherwise.
   bool load_file(std::string file_name, uint64_t &start_address);
+
+  // Load hex files through a binary .rvimg cache next to each file, which is
+  // written when missing or older than the hex file, and mapped otherwise.
+  // Cached pages are mapped copy-on-write as the storage of guest pages, so
+  // simulators loading the same image share it until they write to it.
+  void set_image_cache(bool enabled) { this->use_image_cache = enabled; }
+
+  // Save the contents of memory and a machine state to a snapshot file, or
+  // replace them with those of a snapshot holding state_size doublewords of
+  // state. The file is page-aligned, and restored pages are mapped
+  // copy-on-write rather than read. Return false if the file could not be
+  // written, or is not a valid snapshot, in which case memory is unchanged.
+  //
+  // A snapshot saved with a chain other than 0 is the base of a chain of
+  // incremental snapshots, whose file names add .1, .2 and so on. Restoring
+  // the base applies every snapshot of the chain in turn.
+  bool save_snapshot(std::string file_name, const std::vector<uint64_t> &state,
+                     uint64_t chain = 0);
+  bool restore_snapshot(std::string file_name, std::vector<uint64_t> &state,
+                        size_t state_size);
+
+  // Track the pages written from now on, including pages of the window, and
+  // return the generation from which to find them. Pages are tracked by
+  // generation so that several users can each find the pages written since
+  // they last looked.
+  uint64_t track_dirty_pages();
+
+  // Start a new generation, and return it
+  uint64_t start_dirty_generation();
+
+  // Find the page numbers of pages written in or after a generation, in
+  // order. Pages which are now zero are included. Finding the pages of a
+  // recent generation takes time in proportion to their number.
+  void dirty_pages(uint64_t since, std::vector<uint64_t> &keys);
+
+  // Whether memory was replaced by a snapshot in or after a generation, so
+  // that every page may have changed
+  bool replaced_since(uint64_t since);
+
+  // Find the page numbers of RAM pages which are not all zeros, in order
+  void stored_pages(std::vector<uint64_t> &keys);
+
+  // Copy the contents of pages, one after another
+  void copy_pages(const std::vector<uint64_t> &keys,
+                  std::vector<uint8_t> &contents);
+
+  // Write pages copied by copy_pages and a machine state to the
+  // snapshot with a sequence number in a chain. Only the arguments are used,
+  // so this may run on another thread.
+  static bool write_snapshot(std::string file_name, uint64_t chain,
+                             uint64_t sequence,
+                             const std::vector<uint64_t> &state,
+                             const std::vector<uint64_t> &keys,
+                             const std::vector<uint8_t> &contents);
+
+  // End of the highest address loaded by load_file, or 0 if none
+  uint64_t get_image_end() { return this->image_end; }
+
+  // Display page allocation statistics
+  void show_statistics();
 };
 
 #endif
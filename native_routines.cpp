@@ -0,0 +1,136 @@
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class members for running hot C library routines natively
+
+**************************************************************** */
+
+#include <algorithm>
+#include <cstring>
+
+#include "native_routines.h"
+#include "processor.h"
+
+// Transfers go through host buffers a chunk at a time
+static constexpr uint64_t chunk_size = 1 << 16;
+
+// Argument and result registers
+static constexpr unsigned int a0 = 10;
+static constexpr unsigned int a1 = 11;
+static constexpr unsigned int a2 = 12;
+
+// Constructor
+native_routines::native_routines(processor *cpu, memory *main_memory,
+                                 uint64_t cost_per_byte)
+    : cpu(cpu), main_memory(main_memory), cost_per_byte(cost_per_byte),
+      buffer(chunk_size), other_buffer(chunk_size) {}
+
+unsigned int native_routines::add_symbols(const symbol_table &symbols) {
+  static const std::pair<const char *, Routine> names[] = {
+      {"memcpy", Routine::Memcpy}, {"memmove", Routine::Memmove},
+      {"memset", Routine::Memset}, {"strlen", Routine::Strlen},
+      {"memcmp", Routine::Memcmp}};
+  unsigned int found = 0;
+  for (const auto &name : names) {
+    uint64_t address;
+    if (symbols.find(name.first, address)) {
+      this->entries[address] = name.second;
+      found++;
+    }
+  }
+  return found;
+}
+
+bool native_routines::run(uint64_t address, uint64_t &instructions) {
+  auto entry = this->entries.find(address);
+  if (entry == this->entries.end())
+    return false;
+  uint64_t x10 = this->cpu->get_reg(a0);
+  uint64_t x11 = this->cpu->get_reg(a1);
+  uint64_t x12 = this->cpu->get_reg(a2);
+  uint64_t bytes = x12;
+  uint64_t result = x10;
+  switch (entry->second) {
+  case Routine::Memcpy:
+  case Routine::Memmove:
+    copy(x10, x11, x12);
+    break;
+  case Routine::Memset:
+    fill(x10, x11, x12);
+    break;
+  case Routine::Strlen:
+    result = length(x10, bytes);
+    break;
+  case Routine::Memcmp:
+    result = compare(x10, x11, x12, bytes);
+    break;
+  }
+  this->cpu->set_reg(a0, result);
+  instructions = 1 + bytes * this->cost_per_byte;
+  return true;
+}
+
+// Chunks are copied in the direction that is safe for overlapping ranges, as
+// memmove does
+void native_routines::copy(uint64_t destination, uint64_t source,
+                               uint64_t size) {
+  bool backwards = destination > source && destination - source < size;
+  for (uint64_t done = 0; done < size;) {
+    uint64_t length = std::min(size - done, chunk_size);
+    uint64_t offset = backwards ? size - done - length : done;
+    this->main_memory->read_block(source + offset, this->buffer.data(),
+                                  length);
+    this->main_memory->write_block(destination + offset, this->buffer.data(),
+                                   length);
+    done += length;
+  }
+}
+
+void native_routines::fill(uint64_t destination, uint8_t value,
+                               uint64_t size) {
+  std::fill(this->buffer.begin(), this->buffer.end(), value);
+  for (uint64_t done = 0; done < size;) {
+    uint64_t length = std::min(size - done, chunk_size);
+    this->main_memory->write_block(destination + done, this->buffer.data(),
+                                   length);
+    done += length;
+  }
+}
+
+// Strings are read a page at a time, so no page beyond the terminator is
+// touched
+uint64_t native_routines::length(uint64_t string, uint64_t &bytes) {
+  uint64_t page_size = 1ULL << memory::page_bits;
+  uint64_t address = string;
+  while (true) {
+    uint64_t chunk = page_size - (address & (page_size - 1));
+    this->main_memory->read_block(address, this->buffer.data(), chunk);
+    const void *end = memchr(this->buffer.data(), 0, chunk);
+    if (end) {
+      address += static_cast<const uint8_t *>(end) - this->buffer.data();
+      bytes = address - string + 1;
+      return address - string;
+    }
+    address += chunk;
+  }
+}
+
+int64_t native_routines::compare(uint64_t first, uint64_t second,
+                                 uint64_t size, uint64_t &bytes) {
+  for (uint64_t done = 0; done < size;) {
+    uint64_t length = std::min(size - done, chunk_size);
+    this->main_memory->read_block(first + done, this->buffer.data(), length);
+    this->main_memory->read_block(second + done, this->other_buffer.data(),
+                                  length);
+    for (uint64_t i = 0; i < length; i++) {
+      if (this->buffer[i] != this->other_buffer[i]) {
+        bytes = done + i + 1;
+        return static_cast<int>(this->buffer[i]) - this->other_buffer[i];
+      }
+    }
+    done += length;
+  }
+  bytes = size;
+  return 0;
+}
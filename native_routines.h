@@ -0,0 +1,58 @@
+#ifndef NATIVE_ROUTINES_H
+#define NATIVE_ROUTINES_H
+
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class for running hot C library routines natively
+
+**************************************************************** */
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "memory.h"
+#include "symbols.h"
+
+class processor;
+
+// When a call reaches the entry of memcpy, memmove, memset, strlen or memcmp,
+// the routine is run on the host against memory, its result is placed in a0,
+// and execution continues at ra. Memory and a0 end up as the guest routine
+// would leave them. Temporary registers are left untouched.
+class native_routines {
+
+public:
+  // Constructor. Each call retires the jump into the routine, a return, and
+  // cost_per_byte instructions for each byte the routine processes.
+  native_routines(processor *cpu, memory *main_memory, uint64_t cost_per_byte);
+
+  // Intercept the routines found in a symbol table. Returns the number found.
+  unsigned int add_symbols(const symbol_table &symbols);
+
+  // If address is the entry of an intercepted routine, run it and return
+  // true, with the number of instructions to retire beyond the call.
+  bool run(uint64_t address, uint64_t &instructions);
+
+private:
+  enum class Routine { Memcpy, Memmove, Memset, Strlen, Memcmp };
+
+  // We do not have ownership over these objects! Do not free them!
+  processor *cpu;
+  memory *main_memory;
+
+  uint64_t cost_per_byte;
+  std::unordered_map<uint64_t, Routine> entries;
+  std::vector<uint8_t> buffer;
+  std::vector<uint8_t> other_buffer;
+
+  void copy(uint64_t destination, uint64_t source, uint64_t size);
+  void fill(uint64_t destination, uint8_t value, uint64_t size);
+  uint64_t length(uint64_t string, uint64_t &bytes);
+  int64_t compare(uint64_t first, uint64_t second, uint64_t size,
+                  uint64_t &bytes);
+};
+
+#endif
@@ -0,0 +1,135 @@
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class members for page_codec
+
+**************************************************************** */
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#include "page_codec.h"
+
+static uint32_t read32(const uint8_t *bytes) {
+  uint32_t value;
+  memcpy(&value, bytes, sizeof(value));
+  return value;
+}
+
+// Lengths of 15 or more continue in bytes of 255 and a final smaller byte
+bool page_codec::put_length(uint8_t *&out, uint8_t *end, size_t length) {
+  if (length < 15)
+    return true;
+  for (length -= 15; length >= 255; length -= 255) {
+    if (out == end)
+      return false;
+    *out++ = 255;
+  }
+  if (out == end)
+    return false;
+  *out++ = length;
+  return true;
+}
+
+size_t page_codec::compress(const uint8_t *in, size_t size, uint8_t *out,
+                            size_t capacity) {
+  std::array<uint32_t, 1 << hash_bits> table;
+  table.fill(~0U);
+  uint8_t *start = out;
+  uint8_t *end = out + capacity;
+  size_t anchor = 0;
+  size_t position = 0;
+  while (true) {
+    size_t match = 0;
+    size_t length = 0;
+    while (position + min_match <= size) {
+      uint32_t sequence = read32(in + position);
+      uint32_t &entry = table[(sequence * 2654435761U) >> (32 - hash_bits)];
+      match = entry;
+      entry = position;
+      if (match != ~0U && position - match <= 0xffff &&
+          read32(in + match) == sequence) {
+        length = min_match;
+        while (position + length < size &&
+               in[match + length] == in[position + length])
+          length++;
+        break;
+      }
+      position++;
+    }
+    if (length == 0)
+      position = size;
+    // Token, literal length, literals, then the match if there is one
+    size_t literals = position - anchor;
+    if (out == end)
+      return 0;
+    uint8_t *token = out++;
+    *token = std::min<size_t>(literals, 15) << 4;
+    if (!put_length(out, end, literals) ||
+        static_cast<size_t>(end - out) < literals)
+      return 0;
+    memcpy(out, in + anchor, literals);
+    out += literals;
+    if (length == 0)
+      return out - start;
+    if (end - out < 2)
+      return 0;
+    *out++ = (position - match) & 0xff;
+    *out++ = (position - match) >> 8;
+    *token |= std::min<size_t>(length - min_match, 15);
+    if (!put_length(out, end, length - min_match))
+      return 0;
+    position += length;
+    anchor = position;
+  }
+}
+
+bool page_codec::decompress(const uint8_t *in, size_t in_size, uint8_t *out,
+                            size_t size) {
+  const uint8_t *in_end = in + in_size;
+  size_t position = 0;
+  while (in < in_end) {
+    uint8_t token = *in++;
+    size_t literals = token >> 4;
+    if (literals == 15) {
+      uint8_t extra;
+      do {
+        if (in == in_end)
+          return false;
+        extra = *in++;
+        literals += extra;
+      } while (extra == 255);
+    }
+    if (static_cast<size_t>(in_end - in) < literals ||
+        size - position < literals)
+      return false;
+    memcpy(out + position, in, literals);
+    in += literals;
+    position += literals;
+    // The last sequence has no match
+    if (in == in_end)
+      break;
+    if (in_end - in < 2)
+      return false;
+    size_t offset = in[0] | (in[1] << 8);
+    in += 2;
+    size_t length = (token & 0xf) + min_match;
+    if ((token & 0xf) == 15) {
+      uint8_t extra;
+      do {
+        if (in == in_end)
+          return false;
+        extra = *in++;
+        length += extra;
+      } while (extra == 255);
+    }
+    if (offset == 0 || offset > position || size - position < length)
+      return false;
+    // Matches may overlap the bytes they produce, so copy forwards
+    for (size_t i = 0; i < length; i++, position++)
+      out[position] = out[position - offset];
+  }
+  return position == size;
+}
@@ -0,0 +1,39 @@
+#ifndef PAGE_CODEC_H
+#define PAGE_CODEC_H
+
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class for compressing pages of memory
+
+**************************************************************** */
+
+#include <cstddef>
+#include <cstdint>
+
+// A small LZ77 codec in the style of the LZ4 block format. Each sequence is a
+// token holding the literal and match lengths, a run of literal bytes, and a
+// 16 bit offset back to a match of at least four bytes. Matches are found
+// through a hash of the next four bytes, so compression is a single pass.
+class page_codec {
+
+private:
+  static constexpr unsigned int hash_bits = 12;
+  static constexpr unsigned int min_match = 4;
+
+  static bool put_length(uint8_t *&out, uint8_t *end, size_t length);
+
+public:
+  // Compress size bytes into out, returning the compressed size, or 0 if it
+  // would not fit in capacity bytes
+  static size_t compress(const uint8_t *in, size_t size, uint8_t *out,
+                         size_t capacity);
+
+  // Decompress into exactly size bytes of out. Return false if the input is
+  // malformed.
+  static bool decompress(const uint8_t *in, size_t in_size, uint8_t *out,
+                         size_t size);
+};
+
+#endif
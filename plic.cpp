@@ -0,0 +1,115 @@
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class members for the platform-level interrupt controller
+
+**************************************************************** */
+
+#include "plic.h"
+#include "processor.h"
+
+constexpr uint64_t plic::base;
+
+// mip bit driven by the PLIC
+static constexpr unsigned int meip_bit = 11;
+
+// Source 0 does not exist
+static constexpr uint32_t source_mask = 0xfffffffe;
+
+// Constructor
+plic::plic(processor *cpu)
+    : cpu(cpu), priority({0}), levels(0), pending(0), enabled(0), claimed(0),
+      threshold(0) {}
+
+// Only the pages holding registers are attached, rather than the whole 64MB
+// register space
+void plic::attach(memory *main_memory) {
+  main_memory->add_device(this, base, enable_register + 4);
+  main_memory->add_device(this, base + threshold_register, 8,
+                          threshold_register);
+}
+
+void plic::set_level(unsigned int source, bool level) {
+  uint32_t bit = (1U << source) & source_mask;
+  if (level && !(this->levels & bit) && !(this->claimed & bit))
+    this->pending |= bit;
+  this->levels = level ? this->levels | bit : this->levels & ~bit;
+  update_interrupt();
+}
+
+unsigned int plic::best_source() {
+  unsigned int best = 0;
+  uint8_t best_priority = this->threshold;
+  uint32_t ready = this->pending & this->enabled;
+  for (unsigned int source = 1; ready >> source; source++) {
+    if (((ready >> source) & 1) && this->priority[source] > best_priority) {
+      best = source;
+      best_priority = this->priority[source];
+    }
+  }
+  return best;
+}
+
+void plic::update_interrupt() {
+  this->cpu->set_interrupt_pending(meip_bit, best_source() != 0);
+}
+
+uint32_t plic::read_register(uint64_t offset) {
+  if (offset < sources * 4)
+    return this->priority[offset / 4];
+  unsigned int source;
+  switch (offset) {
+  case pending_register:
+    return this->pending;
+  case enable_register:
+    return this->enabled;
+  case threshold_register:
+    return this->threshold;
+  case claim_register:
+    source = best_source();
+    if (source) {
+      this->pending &= ~(1U << source);
+      this->claimed |= 1U << source;
+      update_interrupt();
+    }
+    return source;
+  default:
+    return 0;
+  }
+}
+
+void plic::write_register(uint64_t offset, uint32_t value) {
+  if (offset < sources * 4) {
+    this->priority[offset / 4] = value & 0x7;
+  } else if (offset == enable_register) {
+    this->enabled = value & source_mask;
+  } else if (offset == threshold_register) {
+    this->threshold = value & 0x7;
+  } else if (offset == claim_register) {
+    // Complete a claim, and pend again if the level is still high
+    uint32_t bit = (1U << (value % sources)) & source_mask & this->claimed;
+    this->claimed &= ~bit;
+    this->pending |= bit & this->levels;
+  } else {
+    return;
+  }
+  update_interrupt();
+}
+
+uint64_t plic::read_doubleword(uint64_t offset, uint64_t mask, uint64_t now) {
+  uint64_t data = 0;
+  if (mask & 0x00000000ffffffffULL)
+    data |= read_register(offset);
+  if (mask & 0xffffffff00000000ULL)
+    data |= static_cast<uint64_t>(read_register(offset + 4)) << 32;
+  return data;
+}
+
+void plic::write_doubleword(uint64_t offset, uint64_t data, uint64_t mask,
+                            uint64_t now) {
+  if (mask & 0x00000000ffffffffULL)
+    write_register(offset, data);
+  if (mask & 0xffffffff00000000ULL)
+    write_register(offset + 4, data >> 32);
+}
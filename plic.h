@@ -0,0 +1,70 @@
+#ifndef PLIC_H
+#define PLIC_H
+
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class for the platform-level interrupt controller
+
+**************************************************************** */
+
+#include <array>
+#include <cstdint>
+
+#include "device.h"
+#include "memory.h"
+
+class processor;
+
+// A PLIC with 31 sources and a single context, machine mode on hart 0, which
+// drives mip.MEIP. Sources are level-triggered: a rising level makes the
+// source pending, and a source whose level is still high when its claim is
+// completed becomes pending again.
+class plic : public device {
+
+public:
+  // Register layout of the SiFive PLIC
+  static constexpr uint64_t base = 0x000000000c000000ULL;
+  static constexpr unsigned int sources = 32;
+  static constexpr uint64_t priority_register = 0x000000; // 4 bytes per source
+  static constexpr uint64_t pending_register = 0x001000;
+  static constexpr uint64_t enable_register = 0x002000;
+  static constexpr uint64_t threshold_register = 0x200000;
+  static constexpr uint64_t claim_register = 0x200004;
+
+  // Constructor
+  plic(processor *cpu);
+
+  // Attach the register ranges to memory
+  void attach(memory *main_memory);
+
+  // Drive the interrupt line from a source
+  void set_level(unsigned int source, bool level);
+
+  uint64_t read_doubleword(uint64_t offset, uint64_t mask,
+                           uint64_t now) override;
+  void write_doubleword(uint64_t offset, uint64_t data, uint64_t mask,
+                        uint64_t now) override;
+
+private:
+  // We do not have ownership over this object! Do not free it!
+  processor *cpu;
+
+  std::array<uint8_t, sources> priority;
+  // One bit per source
+  uint32_t levels;
+  uint32_t pending;
+  uint32_t enabled;
+  uint32_t claimed;
+  uint8_t threshold;
+
+  uint32_t read_register(uint64_t offset);
+  void write_register(uint64_t offset, uint32_t value);
+
+  // Highest priority source which can interrupt, or 0 if there is none
+  unsigned int best_source();
+  void update_interrupt();
+};
+
+#endif
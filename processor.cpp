@@ -8,12 +8,22 @@
 
 #include <iostream>
 #include <iomanip> 
+#include <algorithm>
 #include <array>
+#include <cstring>
 #include "memory.h"
 #include "processor.h"
+#include "syscall_proxy.h"
+#include "native_routines.h"
 
 using CSR = processor::CSR;
 
+constexpr uint64_t processor::tlb_invalid;
+constexpr uint8_t processor::pmp_r;
+constexpr uint8_t processor::pmp_w;
+constexpr uint8_t processor::pmp_x;
+constexpr uint8_t processor::pmp_mixed;
+
 constexpr uint64_t upper32(uint64_t doubleword) {
     return 0xffffffff00000000ULL & doubleword;
 }
@@ -22,6 +32,10 @@ constexpr uint64_t lower32(uint64_t doubleword) {
     return 0xffffffffULL & doubleword;
 }
 
+bool csr_in_range(uint32_t csr_num, CSR first, CSR last) {
+    return csr_num >= static_cast<uint32_t>(first) && csr_num <= static_cast<uint32_t>(last);
+}
+
 constexpr int64_t upper_immediate(uint32_t instruction) {
     return static_cast<int32_t>(instruction & 0xfffff000);
 }
@@ -30,12 +44,20 @@ constexpr int64_t immediate_11_0(uint32_t instruction) {
     return static_cast<int32_t>(instruction & 0xfff00000) >> 20;
 }
 
-bool valid_csr(uint32_t csr_num) {
+bool processor::valid_csr(uint32_t csr_num) {
+    // PMP CSRs only exist when PMP is enabled
+    if (csr_in_range(csr_num, CSR::pmpaddr0, CSR::pmpaddr15)) {
+        return this->pmp_enabled;
+    }
+    if (csr_in_range(csr_num, CSR::cycle, CSR::hpmcounter31)) return true;
+    if (csr_in_range(csr_num, CSR::mhpmcounter3, CSR::mhpmcounter31)) return true;
+    if (csr_in_range(csr_num, CSR::mhpmevent3, CSR::mhpmevent31)) return true;
     switch (static_cast<CSR>(csr_num)) {
         case CSR::mvendorid:
         case CSR::marchid:
         case CSR::mimpid:
         case CSR::mhartid:
+        case CSR::satp:
         case CSR::mstatus:
         case CSR::misa:
         case CSR::mie:
@@ -45,7 +67,14 @@ bool valid_csr(uint32_t csr_num) {
         case CSR::mcause:
         case CSR::mtval:
         case CSR::mip:
+        case CSR::mcounteren:
+        case CSR::mcountinhibit:
+        case CSR::mcycle:
+        case CSR::minstret:
             return true;
+        case CSR::pmpcfg0:
+        case CSR::pmpcfg2:
+            return this->pmp_enabled;
         default:
             return false;
     }
@@ -58,10 +87,17 @@ void processor::execute(unsigned int num, bool breakpoint_check) {
         // Stop execution early
         //if (this->verbose) std::cout << "Running instruction at 0x" << std::setw(16) << std::setfill('0') << std::hex << this->pc << std::endl;
         if (breakpoint_check && this->pc == this->breakpoint) {
-            std::cout << "Breakpoint reached at " << std::setw(16) << std::setfill('0') << std::hex << this->pc << std::endl;
+            if (this->report_breakpoint) std::cout << "Breakpoint reached at " << std::setw(16) << std::setfill('0') << std::hex << this->pc << std::endl;
             break;
         }
+        if (this->halted) break;
         
+        // Run device hooks and events once they are due
+        this->main_memory->tick(this->get_ticks());
+        if (this->instruction_count + this->idle_ticks >= this->event_scheduler->next_event()) {
+            this->event_scheduler->run(this->get_ticks());
+        }
+
         // Check interrupts
         if ((this->mstatus & 0x8) || this->privilege == Privilege::User) {
             // mip.usip && mie.usie -> cause code 0, bitfield 0
@@ -89,8 +125,10 @@ void processor::execute(unsigned int num, bool breakpoint_check) {
             this->exception_handler();
             continue;
         }
-        uint32_t instruction = this->fetch();
+        uint32_t instruction;
+        if (!this->fetch(instruction)) continue;
         uint64_t original_pc = this->pc;
+        if (this->code_map) this->code_map->executed(original_pc);
         
         // Decode
         // Execute
@@ -127,74 +165,101 @@ bool take_branch(uint8_t funct3, uint64_t lval, uint64_t rval, bool& illegal_ins
 
 void processor::load(uint8_t width, size_t dest, size_t base, int64_t offset) {
     bool has_sign = !(width & 0x4);
+    uint8_t size = width & 0x3;
     int64_t address = static_cast<int64_t>(this->registers[base]) + offset;
-    uint64_t doubleword = this->main_memory->read_doubleword(address);
-    uint8_t shift = (static_cast<uint64_t>(address) % 8) * 8;
-    bool misaligned = false;
-    switch (width & 0x3) {
-        case 0x0: // LB, LBU (1 byte)
-            doubleword &= 0x00000000000000ffULL << shift;
-            doubleword >>= shift;
-            if (has_sign) doubleword = static_cast<int64_t>(doubleword << 56) >> 56;
-            break;
-        case 0x1: // LH, LHU (2 bytes)
-            misaligned = shift != (shift & 48);
-            doubleword &= 0x000000000000ffffULL << shift;
-            doubleword >>= shift;
-            if (has_sign) doubleword = static_cast<int64_t>(doubleword << 48) >> 48;
-            break;
-        case 0x2: // LW, LWU (4 bytes)
-            misaligned = shift != (shift & 32);
-            doubleword &= 0x00000000ffffffffULL << shift;
-            doubleword >>= shift;
-            if (has_sign) doubleword = static_cast<int64_t>(doubleword << 32) >> 32;
-            break;
-        case 0x3: // LD (8 bytes)
-            misaligned = shift != 0;
-            break;
-    }
-    if (misaligned) {
+    if (address & ((1ULL << size) - 1)) {
         this->write_csr(CSR::mtval, address);
         this->write_csr(CSR::mcause, 4);
         --this->instruction_count;
         this->exception_handler();
+        return;
+    }
+    // Misaligned exceptions take priority over page faults
+    uint64_t *page = nullptr;
+    uint64_t physical = address;
+    if (this->translation_enabled()) {
+        if (!this->translate(address, Access::Load, 1ULL << size, page, physical)) return;
+    } else {
+        if (this->pmp_active() && !this->pmp_allowed(address, 1ULL << size, Access::Load)) {
+            this->raise_fault(Fault::Access, Access::Load, address);
+            return;
+        }
+        page = this->host_page(address, Access::Load);
+    }
+    uint64_t value = 0;
+    if (page) {
+        value = host_read(page, address, size);
     } else {
-        this->set_reg(dest, doubleword);
+        switch (size) {
+            case 0x0: value = this->main_memory->read8(physical); break;  // LB, LBU
+            case 0x1: value = this->main_memory->read16(physical); break; // LH, LHU
+            case 0x2: value = this->main_memory->read32(physical); break; // LW, LWU
+            case 0x3: value = this->main_memory->read64(physical); break; // LD
+        }
+    }
+    if (has_sign && size < 0x3) {
+        unsigned int unused = 64 - (8 << size);
+        value = static_cast<int64_t>(value << unused) >> unused;
     }
+    this->set_reg(dest, value);
+    ++this->events[static_cast<size_t>(Event::Load)];
 }
 
 void processor::store(uint8_t width, size_t src, size_t base, int64_t offset) {
+    uint8_t size = width & 0x3;
     int64_t address = static_cast<int64_t>(this->registers[base]) + offset;
-    uint64_t doubleword = this->registers[src];
-    uint64_t mask = 0;
-    uint8_t shift = (static_cast<uint64_t>(address) % 8) * 8;
-    bool misaligned = false;
-    switch (width & 0x3) {
-        case 0x0: // SB
-            mask = 0x00000000000000ffULL;
-            break;
-        case 0x1: // SH
-            misaligned = shift != (shift & 0x30);
-            mask = 0x000000000000ffffULL;
-            break;
-        case 0x2: // SW
-            misaligned = shift != (shift & 0x20);
-            mask = 0x00000000ffffffffULL;
-            break;
-        case 0x3: // SD
-            misaligned = shift != 0;
-            mask = 0xffffffffffffffffULL;
-            break;
-    }
-    if (misaligned) {
+    uint64_t value = this->registers[src];
+    if (address & ((1ULL << size) - 1)) {
         this->write_csr(CSR::mtval, address);
         this->write_csr(CSR::mcause, 6);
         --this->instruction_count;
         this->exception_handler();
+        return;
+    }
+    uint64_t *page = nullptr;
+    uint64_t physical = address;
+    if (this->translation_enabled()) {
+        if (!this->translate(address, Access::Store, 1ULL << size, page, physical)) return;
     } else {
-        doubleword <<= shift;
-        mask <<= shift;
-        this->main_memory->write_doubleword(address, doubleword, mask);
+        if (this->pmp_active() && !this->pmp_allowed(address, 1ULL << size, Access::Store)) {
+            this->raise_fault(Fault::Access, Access::Store, address);
+            return;
+        }
+        page = this->host_page(address, Access::Store);
+    }
+    if (page) {
+        host_write(page, address, size, value);
+    } else {
+        switch (size) {
+            case 0x0: this->main_memory->write8(physical, value); break;  // SB
+            case 0x1: this->main_memory->write16(physical, value); break; // SH
+            case 0x2: this->main_memory->write32(physical, value); break; // SW
+            case 0x3: this->main_memory->write64(physical, value); break; // SD
+        }
+    }
+    ++this->events[static_cast<size_t>(Event::Store)];
+}
+
+// Read a naturally aligned value of 1 << size bytes from a host page. Pages
+// hold doublewords in host byte order, which is little-endian like the guest.
+uint64_t processor::host_read(const uint64_t *page, uint64_t address, uint8_t size) {
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(page) + (address & ((1ULL << page_bits) - 1));
+    switch (size) {
+        case 0x0: return *bytes;
+        case 0x1: { uint16_t value; memcpy(&value, bytes, sizeof(value)); return value; }
+        case 0x2: { uint32_t value; memcpy(&value, bytes, sizeof(value)); return value; }
+        default:  { uint64_t value; memcpy(&value, bytes, sizeof(value)); return value; }
+    }
+}
+
+// Write a naturally aligned value of 1 << size bytes to a host page
+void processor::host_write(uint64_t *page, uint64_t address, uint8_t size, uint64_t value) {
+    uint8_t *bytes = reinterpret_cast<uint8_t *>(page) + (address & ((1ULL << page_bits) - 1));
+    switch (size) {
+        case 0x0: *bytes = value; break;
+        case 0x1: { uint16_t narrow = value; memcpy(bytes, &narrow, sizeof(narrow)); break; }
+        case 0x2: { uint32_t narrow = value; memcpy(bytes, &narrow, sizeof(narrow)); break; }
+        default:  memcpy(bytes, &value, sizeof(value)); break;
     }
 }
             
@@ -421,6 +486,9 @@ void processor::execute(uint32_t instruction) {
             // Store return address in rd & update PC
             this->set_reg(rd, this->pc+4);
             this->pc += immediate;
+            ++this->events[static_cast<size_t>(Event::Jump)];
+            if (this->coverage) this->record_edge(this->pc);
+            if (this->natives) this->call_native();
             break;
         case Opcode::JALR: // JALR
             immediate = immediate_11_0(instruction);
@@ -428,6 +496,9 @@ void processor::execute(uint32_t instruction) {
             // Store return address in rd & update PC
             this->set_reg(rd, this->pc+4);
             this->pc = static_cast<uint64_t>(immediate) & 0xfffffffffffffffeULL;
+            ++this->events[static_cast<size_t>(Event::Jump)];
+            if (this->coverage) this->record_edge(this->pc);
+            if (this->natives) this->call_native();
             break;
         case Opcode::BRANCH: // BEQ, BNE, BLT, BGE, BLTU, BGEU
             // Weird immediate encoding needed! 12|10:5, 4:1|11
@@ -437,7 +508,13 @@ void processor::execute(uint32_t instruction) {
             immediate |= static_cast<int32_t>(instruction & 0x00000080) << 4;
             if (take_branch(funct3, this->registers[rs1], this->registers[rs2], illegal_instruction)) {
                 if (illegal_instruction) break;
+                if (this->code_map) this->code_map->branch(this->pc, true);
                 this->pc += static_cast<uint64_t>(immediate);
+                ++this->events[static_cast<size_t>(Event::Branch_Taken)];
+                if (this->coverage) this->record_edge(this->pc);
+            } else if (!illegal_instruction) {
+                if (this->coverage) this->record_edge(this->pc + 4);
+                if (this->code_map) this->code_map->branch(this->pc, false);
             }
             break;
         case Opcode::LOAD: // LB, LH, LW, LBU, LHU | LWU, LD
@@ -493,9 +570,285 @@ void processor::execute(uint32_t instruction) {
     }
 }
 
-uint32_t processor::fetch() {
-    uint64_t doubleword = this->main_memory->read_doubleword(this->pc);
-    return (this->pc & 0x4) ? upper32(doubleword) >> 32 : lower32(doubleword);
+bool processor::fetch(uint32_t& instruction) {
+    uint64_t *page = nullptr;
+    uint64_t physical = this->pc;
+    if (this->translation_enabled()) {
+        if (!this->translate(this->pc, Access::Fetch, 4, page, physical)) return false;
+    } else {
+        if (this->pmp_active() && !this->pmp_allowed(this->pc, 4, Access::Fetch)) {
+            this->raise_fault(Fault::Access, Access::Fetch, this->pc);
+            return false;
+        }
+        page = this->host_page(this->pc, Access::Fetch);
+    }
+    uint64_t doubleword = page ? page[page_index(this->pc)] : this->main_memory->read_doubleword(physical);
+    instruction = (this->pc & 0x4) ? upper32(doubleword) >> 32 : lower32(doubleword);
+    return true;
+}
+
+// Sv39 translation applies to user mode accesses when satp.MODE is 8
+bool processor::translation_enabled() {
+    return this->privilege == Privilege::User && (this->satp >> 60) == 8;
+}
+
+// Translate a virtual address. Raises a page or access fault and returns false
+// if the access is not permitted. Otherwise page is the host storage for the
+// page it maps to, or nullptr if the page is not held in the TLB, in which case
+// the physical address must be accessed instead.
+bool processor::translate(uint64_t address, Access access, uint64_t size, uint64_t*& page, uint64_t& physical) {
+    uint64_t tag = address >> page_bits;
+    tlb_entry& entry = this->tlb[tag & (tlb_size - 1)];
+    if (entry.tags[static_cast<size_t>(access)] == tag) {
+        ++this->tlb_hits;
+        page = entry.page;
+        return true;
+    }
+    ++this->tlb_misses;
+    Fault fault = this->page_walk(address, access, entry, physical);
+    // Pages PMP could not grant as a whole are left out of the TLB
+    if (fault == Fault::None && this->pmp_enabled && entry.tags[static_cast<size_t>(access)] != tag
+        && !this->pmp_allowed(physical, size, access)) {
+        fault = Fault::Access;
+    }
+    if (fault != Fault::None) {
+        this->raise_fault(fault, access, address);
+        return false;
+    }
+    page = entry.tags[static_cast<size_t>(access)] == tag ? entry.page : nullptr;
+    return true;
+}
+
+// Walk the Sv39 page table for a virtual address and fill its TLB entry.
+// A and D bits are not updated by hardware; a clear A bit faults, and a clear
+// D bit withholds write permission.
+processor::Fault processor::page_walk(uint64_t address, Access access, tlb_entry& entry, uint64_t& physical) {
+    // Bits 63:39 must all equal bit 38
+    if (static_cast<uint64_t>(static_cast<int64_t>(address << 25) >> 25) != address) return Fault::Page;
+    uint64_t table = (this->satp & 0xfffffffffffULL) << 12;
+    for (int level = 2; level >= 0; --level) {
+        uint64_t vpn = (address >> (12 + 9 * level)) & 0x1ffULL;
+        if (this->pmp_enabled && !this->pmp_allowed(table + vpn * 8, 8, Access::Load)) return Fault::Access;
+        uint64_t pte = this->main_memory->read_doubleword(table + vpn * 8);
+        bool v = pte & 0x01, r = pte & 0x02, w = pte & 0x04, x = pte & 0x08;
+        bool u = pte & 0x10, a = pte & 0x40, d = pte & 0x80;
+        uint64_t ppn = (pte >> 10) & 0xfffffffffffULL;
+        if (!v || (!r && w)) return Fault::Page;
+        if (!r && !x) {
+            // Pointer to the next level of the page table
+            table = ppn << 12;
+            continue;
+        }
+        uint64_t superpage_mask = (1ULL << (9 * level)) - 1;
+        if (!u || !a || (ppn & superpage_mask)) return Fault::Page;
+        const std::array<bool, 3> allowed = {x, r, w && d};
+        if (!allowed[static_cast<size_t>(access)]) return Fault::Page;
+        uint64_t offset_mask = (1ULL << (12 + 9 * level)) - 1;
+        physical = ((ppn << 12) & ~offset_mask) | (address & offset_mask);
+        uint8_t pmp = pmp_r | pmp_w | pmp_x;
+        uint64_t *page = this->main_memory->page(physical, access == Access::Store);
+        if (page == nullptr) {
+            // Device registers can not be accessed through the TLB
+            pmp = 0;
+        } else if (this->pmp_enabled) {
+            pmp = this->pmp_permissions(physical);
+            if (pmp & pmp_mixed) pmp = 0;
+        }
+        // Pages are only writable through the TLB once a store has asked for
+        // them, as memory may share the storage of pages until written
+        if (access != Access::Store) pmp &= ~pmp_w;
+        // Point at the Sv39 page within the memory page
+        if (page != nullptr) page += memory::address_index(physical) - page_index(physical);
+        uint64_t tag = address >> page_bits;
+        entry.tags[static_cast<size_t>(Access::Fetch)] = (x && (pmp & pmp_x)) ? tag : tlb_invalid;
+        entry.tags[static_cast<size_t>(Access::Load)] = (r && (pmp & pmp_r)) ? tag : tlb_invalid;
+        entry.tags[static_cast<size_t>(Access::Store)] = (w && d && (pmp & pmp_w)) ? tag : tlb_invalid;
+        entry.page = page;
+        if (level > 0) this->tlb_has_superpage = true;
+        this->tlb_filled = true;
+        return Fault::None;
+    }
+    return Fault::Page;
+}
+
+// Wait for an interrupt by skipping idle ticks up to the next scheduled event,
+// which runs before the next instruction. The WFI itself takes one tick.
+void processor::wait_for_interrupt() {
+    if (this->mip & this->mie) return;
+    uint64_t next = this->event_scheduler->next_event();
+    uint64_t now = this->get_ticks();
+    if (next != scheduler::never && next > now + 1) this->idle_ticks += next - now - 1;
+}
+
+void processor::raise_fault(Fault fault, Access access, uint64_t address) {
+    // Instruction (1), load (5) and store (7) access faults
+    // Instruction (12), load (13) and store (15) page faults
+    const std::array<uint64_t, 3> access_causes = {1, 5, 7};
+    const std::array<uint64_t, 3> page_causes = {12, 13, 15};
+    const std::array<uint64_t, 3>& causes = fault == Fault::Page ? page_causes : access_causes;
+    this->write_csr(CSR::mtval, address);
+    this->write_csr(CSR::mcause, causes[static_cast<size_t>(access)]);
+    // A faulting fetch never reaches the end of the execute loop, so only
+    // loads and stores need to undo the instruction count
+    if (access != Access::Fetch) --this->instruction_count;
+    this->exception_handler();
+}
+
+void processor::tlb_flush() {
+    for (tlb_entry& entry: this->tlb) {
+        entry.tags.fill(tlb_invalid);
+        entry.page = nullptr;
+    }
+    this->tlb_has_superpage = false;
+    this->tlb_filled = false;
+}
+
+// Find the host storage for a physical page, or return nullptr for device
+// pages, which are not cached
+uint64_t *processor::host_page(uint64_t address, Access access) {
+    uint64_t tag = address >> page_bits;
+    tlb_entry& entry = this->host_pages[tag & (tlb_size - 1)];
+    if (entry.tags[static_cast<size_t>(access)] == tag) return entry.page;
+    ++this->host_page_misses;
+    uint64_t *page = this->main_memory->page(address, access == Access::Store);
+    if (page == nullptr) return nullptr;
+    entry.tags.fill(tag);
+    // Memory may share the storage of pages until they are written
+    if (access != Access::Store) entry.tags[static_cast<size_t>(Access::Store)] = tlb_invalid;
+    entry.page = page + memory::address_index(address) - page_index(address);
+    return entry.page;
+}
+
+void processor::host_pages_flush(uint64_t address, uint64_t size) {
+    if (size == 0) return;
+    uint64_t first = address >> page_bits;
+    uint64_t last = (address + size - 1) >> page_bits;
+    if (last < first || last - first >= tlb_size) {
+        for (tlb_entry& entry: this->host_pages) entry.tags.fill(tlb_invalid);
+        return;
+    }
+    for (uint64_t tag = first; tag <= last; ++tag) {
+        tlb_entry& entry = this->host_pages[tag & (tlb_size - 1)];
+        if (entry.tags[static_cast<size_t>(Access::Load)] == tag) entry.tags.fill(tlb_invalid);
+    }
+}
+
+// Drop cached host pointers into a range of physical memory. The TLB is
+// indexed by virtual page, so it is flushed as a whole if it has been used.
+void processor::memory_invalidated(uint64_t address, uint64_t size) {
+    this->host_pages_flush(address, size);
+    if (this->tlb_filled) this->tlb_flush();
+}
+
+// Superpages fill one entry per memory page they cover, so they can only be
+// removed by flushing the whole TLB
+void processor::tlb_flush_address(uint64_t address) {
+    if (this->tlb_has_superpage) {
+        this->tlb_flush();
+        return;
+    }
+    uint64_t first = (address & ~0xfffULL) >> page_bits;
+    uint64_t last = (address | 0xfffULL) >> page_bits;
+    for (uint64_t tag = first; tag <= last; ++tag) {
+        this->tlb[tag & (tlb_size - 1)].tags.fill(tlb_invalid);
+    }
+}
+
+// PMP applies to all user mode accesses, and to machine mode accesses once an
+// entry is locked
+bool processor::pmp_active() {
+    return this->pmp_enabled && (this->privilege == Privilege::User || this->pmp_locked);
+}
+
+uint8_t processor::pmp_permission(Access access) {
+    const std::array<uint8_t, 3> permissions = {pmp_x, pmp_r, pmp_w};
+    return permissions[static_cast<size_t>(access)];
+}
+
+// Check an access of size bytes against PMP for the current privilege level
+bool processor::pmp_allowed(uint64_t address, uint64_t size, Access access) {
+    uint8_t permissions = this->pmp_permissions(address);
+    if (permissions & pmp_mixed) return this->pmp_match(address, size, access);
+    return permissions & pmp_permission(access);
+}
+
+// Cached PMP permissions of the page containing an address for the current
+// privilege level
+uint8_t processor::pmp_permissions(uint64_t address) {
+    uint64_t tag = address >> page_bits;
+    pmp_cache_entry& entry = this->pmp_cache[tag & (pmp_cache_size - 1)];
+    if (entry.tag != tag) {
+        ++this->pmp_cache_misses;
+        entry.tag = tag;
+        entry.permissions = this->pmp_page_permissions(address);
+    }
+    return this->privilege == Privilege::Machine ? entry.permissions >> 4 : entry.permissions & 0xf;
+}
+
+// Compute the PMP permissions of the page containing an address for both
+// privilege levels. The lowest numbered entry overlapping the page decides.
+uint8_t processor::pmp_page_permissions(uint64_t address) {
+    uint64_t first = address & ~((1ULL << page_bits) - 1);
+    uint64_t last = first + ((1ULL << page_bits) - 1);
+    for (size_t i = 0; i < this->pmpcfg.size(); ++i) {
+        uint64_t low, high;
+        this->pmp_range(i, low, high);
+        if (low >= high || high - 1 < first || low > last) continue;
+        if (low > first || high - 1 < last) return pmp_mixed | (pmp_mixed << 4);
+        uint8_t user = this->pmpcfg[i] & (pmp_r | pmp_w | pmp_x);
+        uint8_t machine = (this->pmpcfg[i] & 0x80) ? user : (pmp_r | pmp_w | pmp_x);
+        return user | (machine << 4);
+    }
+    // No match, user mode fails and machine mode succeeds
+    return (pmp_r | pmp_w | pmp_x) << 4;
+}
+
+// Check an access against each PMP entry in turn
+bool processor::pmp_match(uint64_t address, uint64_t size, Access access) {
+    for (size_t i = 0; i < this->pmpcfg.size(); ++i) {
+        uint64_t low, high;
+        this->pmp_range(i, low, high);
+        if (low >= high || address + size <= low || address >= high) continue;
+        // Accesses only partly matching an entry fail
+        if (address < low || address + size > high) return false;
+        if (this->privilege == Privilege::Machine && !(this->pmpcfg[i] & 0x80)) return true;
+        return this->pmpcfg[i] & pmp_permission(access);
+    }
+    return this->privilege == Privilege::Machine;
+}
+
+// Address range [low, high) matched by a PMP entry, empty if the entry is off
+void processor::pmp_range(size_t entry, uint64_t& low, uint64_t& high) {
+    uint64_t address = this->pmpaddr[entry];
+    uint64_t trailing_ones = 0;
+    low = high = 0;
+    switch ((this->pmpcfg[entry] >> 3) & 0x3) {
+        case 0x1: // TOR
+            low = entry == 0 ? 0 : this->pmpaddr[entry - 1] << 2;
+            high = address << 2;
+            break;
+        case 0x2: // NA4
+            low = address << 2;
+            high = low + 4;
+            break;
+        case 0x3: // NAPOT
+            while ((address >> trailing_ones) & 1) ++trailing_ones;
+            low = (address & ~((1ULL << trailing_ones) - 1)) << 2;
+            high = low + (8ULL << trailing_ones);
+            break;
+    }
+}
+
+// Called whenever a PMP CSR changes
+void processor::pmp_invalidate() {
+    this->pmp_locked = false;
+    for (uint8_t cfg: this->pmpcfg) {
+        if (cfg & 0x80) this->pmp_locked = true;
+    }
+    for (pmp_cache_entry& entry: this->pmp_cache) {
+        entry.tag = ~0ULL;
+    }
+    this->tlb_flush();
 }
 
 bool processor::system(uint32_t csr, size_t src, size_t dest, uint8_t funct3) {
@@ -503,6 +856,8 @@ bool processor::system(uint32_t csr, size_t src, size_t dest, uint8_t funct3) {
         ECALL   =   0x00,
         EBREAK  =   0x10,
         MRET    =   0x11,
+        SFENCE_VMA  =   0x12,
+        WFI     =   0x13,
         CSRRW   =   0x01,
         CSRRS   =   0x02,
         CSRRC   =   0x03,
@@ -512,23 +867,18 @@ bool processor::system(uint32_t csr, size_t src, size_t dest, uint8_t funct3) {
     };
     if (funct3 != 0) {
         // CSR* calls
-        if (!valid_csr(csr)) return true;
-        if (this->privilege != Privilege::Machine) return true;
+        if (!this->valid_csr(csr)) return true;
+        if (this->privilege != Privilege::Machine && !this->counter_accessible(csr)) return true;
     }
     auto read_only_csr = [](CSR csr){
-        switch (csr) {
-            case CSR::mvendorid:
-            case CSR::marchid:
-            case CSR::mimpid:
-            case CSR::mhartid:
-                return true;
-            default:
-                return false;
-        }
+        // CSR numbers with the top two bits set are read-only
+        return (static_cast<uint32_t>(csr) >> 10) == 0x3;
     };
     Op_Type op = static_cast<Op_Type>(funct3);
     if (op == Op_Type::ECALL && csr == 1) op = Op_Type::EBREAK;
     if (op == Op_Type::ECALL && csr == 0x302) op = Op_Type::MRET;
+    if (op == Op_Type::ECALL && (csr >> 5) == 0x09) op = Op_Type::SFENCE_VMA;
+    if (op == Op_Type::ECALL && csr == 0x105) op = Op_Type::WFI;
     if (op == Op_Type::ECALL && csr != 0) return true;
     uint64_t rs1 = this->registers[src];
     uint64_t csr_val = this->read_csr(csr);
@@ -536,6 +886,10 @@ bool processor::system(uint32_t csr, size_t src, size_t dest, uint8_t funct3) {
     CSR csr_encoded = static_cast<CSR>(csr);
     switch (op) {
         case Op_Type::ECALL:
+            if (this->syscalls) {
+                this->syscalls->handle();
+                break;
+            }
             // Causes environment-call-from-?-mode-exception
             switch (this->get_prv()) {
                 case Privilege::Machine:
@@ -567,6 +921,20 @@ bool processor::system(uint32_t csr, size_t src, size_t dest, uint8_t funct3) {
                     return true;
             }
             break;
+        case Op_Type::SFENCE_VMA:
+            // Requires M privilege, ASID in rs2 is ignored as it is not implemented
+            if (this->get_prv() != Privilege::Machine) return true;
+            if (src == 0) {
+                this->tlb_flush();
+            } else {
+                this->tlb_flush_address(rs1);
+            }
+            break;
+        case Op_Type::WFI:
+            // Requires M privilege
+            if (this->get_prv() != Privilege::Machine) return true;
+            this->wait_for_interrupt();
+            break;
         case Op_Type::CSRRW:
             if (read_only_csr(csr_encoded)) return true;
             this->set_reg(dest, csr_val);
@@ -627,6 +995,11 @@ void processor::exception_handler() {
         std::cout << "Exception called, cause = " << this->mcause << std::endl;
     }
     */
+    if (this->exception_hook && this->exception_hook(this->mcause)) {
+        this->halted = true;
+        return;
+    }
+    ++this->events[static_cast<size_t>((this->mcause >> 63) ? Event::Interrupt : Event::Exception)];
     // Set privilege to machine mode
     this->update_privilege(false);
     // Store address in mepc
@@ -646,16 +1019,27 @@ void processor::exception_handler() {
         // Direct mode
         this->pc = base;
     }
+    if (this->coverage) this->record_edge(this->pc);
 }
 
 // Consructor
-processor::processor (memory* main_memory, bool verbose, bool stage2): 
+processor::processor (memory* main_memory, scheduler* event_scheduler, bool verbose, bool stage2, bool pmp): 
     verbose(verbose),
     instruction_count(0), 
     pc(0), 
     has_breakpoint(false),
+    report_breakpoint(true),
     registers({0}),
     main_memory(main_memory),
+    event_scheduler(event_scheduler),
+    syscalls(nullptr),
+    natives(nullptr),
+    halted(false),
+    coverage(nullptr),
+    previous_location(0),
+    code_map(nullptr),
+    idle_ticks(0),
+    timer(this, event_scheduler),
     mstatus(0x200000000ULL),
     mie(0),
     mtvec(0),
@@ -664,8 +1048,32 @@ processor::processor (memory* main_memory, bool verbose, bool stage2):
     mcause(0),
     mtval(0),
     mip(0),
-    privilege(Privilege::Machine)
-{}
+    satp(0),
+    pmpcfg({0}),
+    pmpaddr({0}),
+    mcounteren(0),
+    mcountinhibit(0),
+    mhpmevent({0}),
+    events({0}),
+    counters(),
+    privilege(Privilege::Machine),
+    tlb_has_superpage(false),
+    tlb_filled(false),
+    tlb_hits(0),
+    tlb_misses(0),
+    host_page_misses(0),
+    pmp_enabled(pmp),
+    pmp_locked(false),
+    pmp_cache_misses(0)
+{
+    this->pmp_invalidate();
+    this->host_pages_flush(0, ~0ULL);
+    this->main_memory->add_invalidate_hook([this](uint64_t address, uint64_t size) {
+        this->memory_invalidated(address, size);
+    });
+    // Stage 1 programs may use the CLINT's addresses as ordinary memory
+    if (stage2) this->main_memory->add_device(&this->timer, clint::base, clint::size);
+}
 
 // Display PC value
 void processor::show_pc() {
@@ -677,6 +1085,11 @@ void processor::set_pc(uint64_t new_pc) {
     pc = new_pc;
 }
 
+// Read PC value
+uint64_t processor::get_pc() {
+    return pc;
+}
+
 // Display register value
 void processor::show_reg(unsigned int reg_num) {
     std::cout << std::setw(16) << std::setfill('0') << std::hex << registers[reg_num] << std::endl;
@@ -688,15 +1101,159 @@ void processor::set_reg(unsigned int reg_num, uint64_t new_value) {
     registers[0] = 0;
 }
 
+uint64_t processor::get_reg(unsigned int reg_num) {
+    return registers[reg_num];
+}
+
+void processor::set_syscall_proxy(syscall_proxy *proxy) {
+    this->syscalls = proxy;
+}
+
+void processor::set_native_routines(native_routines *natives) {
+    this->natives = natives;
+}
+
+// Run the routine at the jump target natively and return to ra. Routines work
+// on physical addresses, so they are only intercepted when accesses would not
+// be translated or checked.
+void processor::call_native() {
+    uint64_t instructions;
+    if (this->translation_enabled() || this->pmp_active()) return;
+    if (!this->natives->run(this->pc, instructions)) return;
+    this->pc = this->registers[1];
+    this->instruction_count += instructions;
+}
+
+void processor::halt() {
+    this->halted = true;
+}
+
+bool processor::is_halted() {
+    return this->halted;
+}
+
+void processor::set_coverage(uint8_t *bitmap) {
+    this->coverage = bitmap;
+    this->previous_location = 0;
+}
+
+constexpr size_t processor::coverage_size;
+
+// Locations are hashed from the target address, since instructions are too
+// closely spaced to be used as they are. The previous location is shifted so
+// that the edges from A to B and from B to A are counted apart.
+void processor::record_edge(uint64_t target) {
+    uint64_t location = ((target >> 4) ^ (target << 8)) & (coverage_size - 1);
+    ++this->coverage[location ^ this->previous_location];
+    this->previous_location = location >> 1;
+}
+
+void processor::set_code_coverage(code_coverage *code_map) {
+    this->code_map = code_map;
+}
+
+void processor::set_exception_hook(std::function<bool(uint64_t cause)> hook) {
+    this->exception_hook = hook;
+}
+
+// Machine state is saved as a sequence of doublewords, in the order below.
+// mtime and mtimecmp are saved as register values, and written back through
+// the CLINT once the tick count is restored so that its timer is rescheduled.
+void processor::save_state(std::vector<uint64_t>& state) {
+    uint64_t now = this->get_ticks();
+    state.push_back(this->instruction_count);
+    state.push_back(this->idle_ticks);
+    state.push_back(this->pc);
+    state.push_back(this->has_breakpoint);
+    state.push_back(this->breakpoint);
+    state.insert(state.end(), this->registers.begin(), this->registers.end());
+    state.push_back(static_cast<uint64_t>(this->privilege));
+    state.push_back(this->halted);
+    state.push_back(this->mstatus);
+    state.push_back(this->mie);
+    state.push_back(this->mtvec);
+    state.push_back(this->mscratch);
+    state.push_back(this->mepc);
+    state.push_back(this->mcause);
+    state.push_back(this->mtval);
+    state.push_back(this->mip);
+    state.push_back(this->satp);
+    state.insert(state.end(), this->pmpcfg.begin(), this->pmpcfg.end());
+    state.insert(state.end(), this->pmpaddr.begin(), this->pmpaddr.end());
+    state.push_back(this->mcounteren);
+    state.push_back(this->mcountinhibit);
+    state.insert(state.end(), this->mhpmevent.begin(), this->mhpmevent.end());
+    state.insert(state.end(), this->events.begin(), this->events.end());
+    for (const counter& c : this->counters) {
+        state.push_back(c.offset);
+        state.push_back(c.frozen);
+    }
+    state.push_back(this->timer.mtime(now));
+    state.push_back(this->timer.read_doubleword(clint::mtimecmp_register, ~0ULL, now));
+}
+
+constexpr size_t processor::state_size;
+
+bool processor::restore_state(const std::vector<uint64_t>& state) {
+    if (state.size() != state_size) return false;
+    auto word = state.begin();
+    this->instruction_count = *word++;
+    this->idle_ticks = *word++;
+    this->pc = *word++;
+    this->has_breakpoint = *word++ != 0;
+    this->breakpoint = *word++;
+    std::copy(word, word + 32, this->registers.begin());
+    word += 32;
+    this->privilege = *word++ == 0 ? Privilege::User : Privilege::Machine;
+    this->halted = *word++ != 0;
+    this->mstatus = *word++;
+    this->mie = *word++;
+    this->mtvec = *word++;
+    this->mscratch = *word++;
+    this->mepc = *word++;
+    this->mcause = *word++;
+    this->mtval = *word++;
+    this->mip = *word++;
+    this->satp = *word++;
+    std::copy(word, word + 16, this->pmpcfg.begin());
+    word += 16;
+    std::copy(word, word + 16, this->pmpaddr.begin());
+    word += 16;
+    this->mcounteren = *word++;
+    this->mcountinhibit = *word++;
+    std::copy(word, word + 32, this->mhpmevent.begin());
+    word += 32;
+    std::copy(word, word + 8, this->events.begin());
+    word += 8;
+    for (counter& c : this->counters) {
+        c.offset = *word++;
+        c.frozen = *word++;
+    }
+    uint64_t now = this->get_ticks();
+    this->timer.write_doubleword(clint::mtime_register, *word++, ~0ULL, now);
+    this->timer.write_doubleword(clint::mtimecmp_register, *word++, ~0ULL, now);
+    // Cached translations and permissions belong to the old state
+    this->pmp_invalidate();
+    this->host_pages_flush(0, ~0ULL);
+    return true;
+}
+
 // Clear breakpoint
 void processor::clear_breakpoint() {
     has_breakpoint = false;
 }
 
 // Set breakpoint at an address
-void processor::set_breakpoint(uint64_t address) {
+void processor::set_breakpoint(uint64_t address, bool report) {
     has_breakpoint = true;
     breakpoint = address;
+    report_breakpoint = report;
+}
+
+// Get the breakpoint address, if there is one
+bool processor::get_breakpoint(uint64_t& address) {
+    address = breakpoint;
+    return has_breakpoint;
 }
 
 // Show privilege level
@@ -732,7 +1289,7 @@ processor::Privilege processor::get_prv()
 // Empty implementation for stage 1, required for stage 2
 void processor::show_csr(unsigned int csr_num)
 {
-    if (valid_csr(csr_num)) {
+    if (this->valid_csr(csr_num)) {
         std::cout << std::setw(16) << std::setfill('0') << std::hex << this->read_csr(csr_num) << '\n';
     } else {
         std::cout << "Illegal CSR number" << std::endl;
@@ -745,6 +1302,12 @@ void processor::write_csr(CSR csr, uint64_t new_value) {
         case CSR::mip:
             new_value = (new_value & 0x111ULL) | (this->mip & 0x888ULL);
             break;
+        case CSR::mcycle:
+        case CSR::minstret:
+            // The write takes precedence over the increment for the writing
+            // instruction, which retires in one cycle
+            if (!((this->mcountinhibit >> (static_cast<uint32_t>(csr) & 0x1f)) & 1)) --new_value;
+            break;
         default:
             break;
     }
@@ -761,6 +1324,33 @@ void processor::set_csr(unsigned int csr_num, uint64_t new_value)
     uint64_t mask;
     uint64_t fixed;
     CSR csr = static_cast<CSR>(csr_num);
+    if (csr_in_range(csr_num, CSR::cycle, CSR::hpmcounter31)) {
+        std::cout << "Illegal write to read-only CSR" << std::endl;
+        return;
+    }
+    if (csr_in_range(csr_num, CSR::mhpmcounter3, CSR::mhpmcounter31)) {
+        this->write_counter(csr_num & 0x1f, new_value);
+        return;
+    }
+    if (csr_in_range(csr_num, CSR::mhpmevent3, CSR::mhpmevent31)) {
+        // Unsupported events read as 0. The counter keeps its value when
+        // its event changes
+        size_t index = csr_num & 0x1f;
+        uint64_t value = this->read_counter(index);
+        this->mhpmevent[index] = new_value < this->events.size() ? new_value : 0;
+        this->write_counter(index, value);
+        return;
+    }
+    if (csr_in_range(csr_num, CSR::pmpaddr0, CSR::pmpaddr15)) {
+        // Address bits 55:2 implemented. Locked entries, and the entry below
+        // a locked TOR entry, ignore writes
+        size_t entry = csr_num - static_cast<uint32_t>(CSR::pmpaddr0);
+        if (this->pmpcfg[entry] & 0x80) return;
+        if (entry + 1 < this->pmpcfg.size() && (this->pmpcfg[entry + 1] & 0x98) == 0x88) return;
+        this->pmpaddr[entry] = new_value & 0x003fffffffffffffULL;
+        this->pmp_invalidate();
+        return;
+    }
     switch (csr) {
         case CSR::mvendorid:
         case CSR::marchid:
@@ -768,6 +1358,14 @@ void processor::set_csr(unsigned int csr_num, uint64_t new_value)
         case CSR::mhartid:
             std::cout << "Illegal write to read-only CSR" << std::endl;
             break;
+        case CSR::satp:
+            // Bare (0) and Sv39 (8) modes implemented, writing any other
+            // mode has no effect. ASID fixed at 0
+            if ((new_value >> 60) != 0 && (new_value >> 60) != 8) break;
+            mask    = 0xf0000fffffffffffULL;
+            this->satp = new_value & mask;
+            this->tlb_flush();
+            break;
         case CSR::mstatus:
             // mie, mpie, mpp implemented
             // uxl fixed at 2
@@ -788,6 +1386,17 @@ void processor::set_csr(unsigned int csr_num, uint64_t new_value)
             //mask  = 0b100110011001ULL;
             this->mie = new_value & mask;
             break;
+        case CSR::mcounteren:
+            this->mcounteren = static_cast<uint32_t>(new_value);
+            break;
+        case CSR::mcountinhibit:
+            // time can not be inhibited
+            this->set_counter_inhibit(static_cast<uint32_t>(new_value) & ~0x2U);
+            break;
+        case CSR::mcycle:
+        case CSR::minstret:
+            this->write_counter(csr_num & 0x1f, new_value);
+            break;
         case CSR::mtvec:
             fixed = new_value & 1;
             mask = fixed ? ~0xfe : ~0x2;
@@ -817,10 +1426,34 @@ void processor::set_csr(unsigned int csr_num, uint64_t new_value)
             //mask  = 0b100110011001ULL;
             this->mip = new_value & mask;
             break;
+        case CSR::pmpcfg0:
+        case CSR::pmpcfg2:
+            // One byte per entry: r, w, x, a and l implemented. Locked
+            // entries ignore writes, and w is cleared without r
+            for (size_t i = 0; i < 8; ++i) {
+                size_t entry = (csr == CSR::pmpcfg0 ? 0 : 8) + i;
+                uint8_t cfg = (new_value >> (8 * i)) & 0x9f;
+                if (!(cfg & pmp_r)) cfg &= ~pmp_w;
+                if (!(this->pmpcfg[entry] & 0x80)) this->pmpcfg[entry] = cfg;
+            }
+            this->pmp_invalidate();
+            break;
+        default:
+            break;
     };
 }
 
 uint64_t processor::read_csr(uint32_t csr) {
+    if (csr_in_range(csr, CSR::pmpaddr0, CSR::pmpaddr15)) {
+        return this->pmpaddr[csr - static_cast<uint32_t>(CSR::pmpaddr0)];
+    }
+    if (csr_in_range(csr, CSR::cycle, CSR::hpmcounter31) || csr_in_range(csr, CSR::mcycle, CSR::mhpmcounter31)) {
+        return this->read_counter(csr & 0x1f);
+    }
+    if (csr_in_range(csr, CSR::mhpmevent3, CSR::mhpmevent31)) {
+        return this->mhpmevent[csr & 0x1f];
+    }
+    uint64_t value = 0;
     switch (static_cast<CSR>(csr)) {
         case CSR::mvendorid:
             return 0ULL;
@@ -834,6 +1467,9 @@ uint64_t processor::read_csr(uint32_t csr) {
         case CSR::mhartid:
             return 0ULL;
             break;
+        case CSR::satp:
+            return this->satp;
+            break;
         case CSR::mstatus:
             return this->mstatus;
             break;
@@ -846,6 +1482,12 @@ uint64_t processor::read_csr(uint32_t csr) {
         case CSR::mtvec:
             return this->mtvec;
             break;
+        case CSR::mcounteren:
+            return this->mcounteren;
+            break;
+        case CSR::mcountinhibit:
+            return this->mcountinhibit;
+            break;
         case CSR::mscratch:
             return this->mscratch;
             break;
@@ -861,6 +1503,13 @@ uint64_t processor::read_csr(uint32_t csr) {
         case CSR::mip:
             return this->mip;
             break;
+        case CSR::pmpcfg0:
+        case CSR::pmpcfg2:
+            for (size_t i = 8; i-- > 0;) {
+                value = (value << 8) | this->pmpcfg[(csr == static_cast<uint32_t>(CSR::pmpcfg0) ? 0 : 8) + i];
+            }
+            return value;
+            break;
         default:
             return 0ULL;
     };
@@ -870,7 +1519,90 @@ uint64_t processor::get_instruction_count() {
     return instruction_count;
 }
 
+uint64_t processor::get_ticks() {
+    return this->instruction_count + this->idle_ticks;
+}
+
+void processor::set_interrupt_pending(unsigned int bit, bool pending) {
+    if (pending) {
+        this->mip |= 1ULL << bit;
+    } else {
+        this->mip &= ~(1ULL << bit);
+    }
+}
+
+bool processor::get_interrupt_pending(unsigned int bit) {
+    return (this->mip >> bit) & 1;
+}
+
 // Used for Postgraduate assignment. Undergraduate assignment can return 0.
 uint64_t processor::get_cycle_count() {
-    return 0;
+    return this->cycles();
+}
+
+// Timing model: one cycle per instruction, plus one for each taken branch,
+// jump and store, and two for each load. Cycles continue while idle in WFI.
+uint64_t processor::cycles() {
+    return this->instruction_count + this->idle_ticks
+        + this->events[static_cast<size_t>(Event::Branch_Taken)]
+        + this->events[static_cast<size_t>(Event::Jump)]
+        + this->events[static_cast<size_t>(Event::Store)]
+        + 2 * this->events[static_cast<size_t>(Event::Load)];
+}
+
+// Value a counter follows while it is not inhibited
+uint64_t processor::counter_source(size_t index) {
+    switch (index) {
+        case 0: // cycle
+            return this->cycles();
+        case 1: // time
+            return this->timer.mtime(this->get_ticks());
+        case 2: // instret
+            return this->instruction_count;
+        default:
+            switch (static_cast<Event>(this->mhpmevent[index])) {
+                case Event::None:
+                    return 0;
+                case Event::TLB_Miss:
+                    return this->tlb_misses;
+                default:
+                    return this->events[this->mhpmevent[index]];
+            }
+    }
+}
+
+uint64_t processor::read_counter(size_t index) {
+    if ((this->mcountinhibit >> index) & 1) return this->counters[index].frozen;
+    return this->counter_source(index) + this->counters[index].offset;
+}
+
+void processor::write_counter(size_t index, uint64_t value) {
+    this->counters[index].frozen = value;
+    this->counters[index].offset = value - this->counter_source(index);
+}
+
+void processor::set_counter_inhibit(uint32_t inhibit) {
+    for (size_t index = 0; index < this->counters.size(); ++index) {
+        uint64_t value = this->read_counter(index);
+        bool inhibited = (inhibit >> index) & 1;
+        if (inhibited != ((this->mcountinhibit >> index) & 1)) {
+            this->mcountinhibit ^= 1U << index;
+            this->write_counter(index, value);
+        }
+    }
+}
+
+// User mode may read the counters enabled in mcounteren
+bool processor::counter_accessible(uint32_t csr_num) {
+    return csr_in_range(csr_num, CSR::cycle, CSR::hpmcounter31) && ((this->mcounteren >> (csr_num & 0x1f)) & 1);
+}
+
+// Display TLB, host page cache and PMP cache statistics
+void processor::show_statistics() {
+    std::cout << "TLB hits: " << std::dec << this->tlb_hits << std::endl;
+    std::cout << "TLB misses: " << std::dec << this->tlb_misses << std::endl;
+    std::cout << "Host page cache misses: " << std::dec << this->host_page_misses << std::endl;
+    if (this->pmp_enabled) {
+        std::cout << "PMP cache misses: " << std::dec << this->pmp_cache_misses << std::endl;
+    }
 }
@@ -9,8 +9,16 @@
 
 **************************************************************** */
 
+#include "clint.h"
+#include "code_coverage.h"
 #include "memory.h"
+#include "scheduler.h"
 #include <array>
+#include <functional>
+#include <vector>
+
+class syscall_proxy;
+class native_routines;
 
 class processor {
 public:
@@ -19,15 +27,33 @@ public:
     marchid     = 0xF12,
     mimpid      = 0xF13,
     mhartid     = 0xF14,
+    cycle       = 0xC00, // URO
+    time        = 0xC01,
+    instret     = 0xC02,
+    hpmcounter3 = 0xC03,
+    hpmcounter31 = 0xC1F,
+    satp        = 0x180, // SRW
     mstatus     = 0x300, // MRW
     misa        = 0x301,
     mie         = 0x304,
     mtvec       = 0x305,
+    mcounteren  = 0x306,
+    mcountinhibit = 0x320,
+    mhpmevent3  = 0x323,
+    mhpmevent31 = 0x33F,
     mscratch    = 0x340,
     mepc        = 0x341,
     mcause      = 0x342,
     mtval       = 0x343,
     mip         = 0x344,
+    pmpcfg0     = 0x3A0,
+    pmpcfg2     = 0x3A2,
+    pmpaddr0    = 0x3B0,
+    pmpaddr15   = 0x3BF,
+    mcycle      = 0xB00,
+    minstret    = 0xB02,
+    mhpmcounter3 = 0xB03,
+    mhpmcounter31 = 0xB1F,
   };
 
 private:
@@ -38,10 +64,34 @@ private:
   // We are using C++11 so unfortunately I can't use optional.
   bool has_breakpoint;
   uint64_t breakpoint;
+  bool report_breakpoint;
   std::array<uint64_t, 32> registers;
 
-  // We do not have ownership over this object! Do not free it!
+  // We do not have ownership over these objects! Do not free them!
   memory *main_memory;
+  scheduler *event_scheduler;
+  syscall_proxy *syscalls;
+  native_routines *natives;
+
+  // Set once the program exits, after which no more instructions execute
+  bool halted;
+
+  // Edge coverage in the style of AFL. Each jump, branch and trap counts the
+  // edge from the previous one in a bitmap, indexed by a hash of the two
+  // target addresses.
+  uint8_t *coverage;
+  uint64_t previous_location;
+  void record_edge(uint64_t target);
+
+  // Instructions executed and branch directions, if not nullptr
+  code_coverage *code_map;
+
+  std::function<bool(uint64_t cause)> exception_hook;
+
+  // Ticks skipped by WFI, see get_ticks
+  uint64_t idle_ticks;
+  // Mapped into memory in stage 2 only
+  clint timer;
 
   // Control and Status Registers
   uint64_t mstatus;
@@ -52,6 +102,42 @@ private:
   uint64_t mcause;
   uint64_t mtval;
   uint64_t mip;
+  uint64_t satp;
+  std::array<uint8_t, 16> pmpcfg;
+  std::array<uint64_t, 16> pmpaddr;
+  uint32_t mcounteren;
+  uint32_t mcountinhibit;
+  std::array<uint64_t, 32> mhpmevent;
+
+  // Events which may be selected by mhpmevent
+  enum class Event : uint8_t {
+    None = 0,
+    Load = 1,
+    Store = 2,
+    Branch_Taken = 3,
+    Jump = 4,
+    Exception = 5,
+    Interrupt = 6,
+    TLB_Miss = 7,
+  };
+  std::array<uint64_t, 8> events;
+
+  // Hardware performance counters, indexed by the low 5 bits of their CSR
+  // number. Counters are derived from instruction_count and the event counts
+  // when read rather than incremented every instruction, so writes and
+  // mcountinhibit only change the offset from their source.
+  struct counter {
+    uint64_t offset;
+    uint64_t frozen;
+  };
+  std::array<counter, 32> counters;
+
+  uint64_t cycles();
+  uint64_t counter_source(size_t index);
+  uint64_t read_counter(size_t index);
+  void write_counter(size_t index, uint64_t value);
+  void set_counter_inhibit(uint32_t inhibit);
+  bool counter_accessible(uint32_t csr_num);
 
   // use uint16_t or cout will try to print a char
   enum class Privilege : uint16_t {
@@ -61,7 +147,97 @@ private:
 
   Privilege privilege;
 
-  uint32_t fetch();
+  // Sv39 virtual memory
+  enum class Access : uint8_t {
+    Fetch = 0,
+    Load = 1,
+    Store = 2,
+  };
+
+  enum class Fault : uint8_t {
+    None = 0,
+    Access = 1,
+    Page = 2,
+  };
+
+  // Translation lookaside buffer, direct mapped on the virtual page number of
+  // each 4 Kbyte Sv39 page. An entry caches a pointer to the host storage for
+  // the page, and a tag per access type which only matches if the access is
+  // permitted, so a hit costs a single compare.
+  struct tlb_entry {
+    std::array<uint64_t, 3> tags;
+    uint64_t *page;
+  };
+  static constexpr unsigned int page_bits = 12;
+  // Index of the doubleword containing an address within its Sv39 page
+  static constexpr uint64_t page_index(uint64_t address) {
+    return (address >> 3) & ((1ULL << (page_bits - 3)) - 1);
+  }
+  static uint64_t host_read(const uint64_t *page, uint64_t address,
+                            uint8_t size);
+  static void host_write(uint64_t *page, uint64_t address, uint8_t size,
+                         uint64_t value);
+  // TLB entries point into memory pages, so each must hold whole Sv39 pages
+  static_assert(memory::page_bits >= page_bits,
+                "memory pages must be at least 4 Kbytes");
+  static constexpr size_t tlb_size = 256;
+  static constexpr uint64_t tlb_invalid = ~0ULL;
+  std::array<tlb_entry, tlb_size> tlb;
+  bool tlb_has_superpage;
+  bool tlb_filled;
+  uint64_t tlb_hits;
+  uint64_t tlb_misses;
+
+  // Host storage of physical pages accessed without translation, cached the
+  // same way so that most fetches, loads and stores skip memory's page lookup.
+  // Flushed through memory's invalidate hook.
+  std::array<tlb_entry, tlb_size> host_pages;
+  uint64_t host_page_misses;
+  uint64_t *host_page(uint64_t address, Access access);
+  void host_pages_flush(uint64_t address, uint64_t size);
+  void memory_invalidated(uint64_t address, uint64_t size);
+
+  bool translation_enabled();
+  bool translate(uint64_t address, Access access, uint64_t size,
+                 uint64_t *&page, uint64_t &physical);
+  Fault page_walk(uint64_t address, Access access, tlb_entry &entry,
+                  uint64_t &physical);
+  void raise_fault(Fault fault, Access access, uint64_t address);
+  void tlb_flush();
+  void tlb_flush_address(uint64_t address);
+
+  // Physical memory protection, only enforced when enabled at construction.
+  // Permissions of each memory page are cached for both privilege levels
+  // (user in the low nibble, machine in the high nibble) so most accesses
+  // need a single compare rather than a search of all 16 entries. Pages only
+  // partly covered by an entry are marked mixed and checked exactly.
+  static constexpr uint8_t pmp_r = 0x1;
+  static constexpr uint8_t pmp_w = 0x2;
+  static constexpr uint8_t pmp_x = 0x4;
+  static constexpr uint8_t pmp_mixed = 0x8;
+  struct pmp_cache_entry {
+    uint64_t tag;
+    uint8_t permissions;
+  };
+  static constexpr size_t pmp_cache_size = 256;
+  bool pmp_enabled;
+  bool pmp_locked;
+  std::array<pmp_cache_entry, pmp_cache_size> pmp_cache;
+  uint64_t pmp_cache_misses;
+
+  bool pmp_active();
+  bool pmp_allowed(uint64_t address, uint64_t size, Access access);
+  uint8_t pmp_permissions(uint64_t address);
+  uint8_t pmp_page_permissions(uint64_t address);
+  bool pmp_match(uint64_t address, uint64_t size, Access access);
+  void pmp_range(size_t entry, uint64_t &low, uint64_t &high);
+  void pmp_invalidate();
+  static uint8_t pmp_permission(Access access);
+
+  void wait_for_interrupt();
+
+  bool fetch(uint32_t &instruction);
+  void call_native();
   void execute(uint32_t instruction);
   void load(uint8_t width, size_t dest, size_t base, int64_t offset);
   void store(uint8_t width, size_t src, size_t base, int64_t offset);
@@ -69,12 +245,14 @@ private:
   void exception_handler();
   void update_privilege(bool mret);
   Privilege get_prv();
+  bool valid_csr(uint32_t csr_num);
   uint64_t read_csr(uint32_t csr);
   void write_csr(CSR csr, uint64_t new_value);
 
 public:
   // Consructor
-  processor(memory *main_memory, bool verbose, bool stage2);
+  processor(memory *main_memory, scheduler *event_scheduler, bool verbose,
+            bool stage2, bool pmp);
 
   // Display PC value
   void show_pc();
@@ -82,20 +260,30 @@ public:
   // Set PC to new value
   void set_pc(uint64_t new_pc);
 
+  // Read PC value
+  uint64_t get_pc();
+
   // Display register value
   void show_reg(unsigned int reg_num);
 
   // Set register to new value
   void set_reg(unsigned int reg_num, uint64_t new_value);
 
+  // Read register value
+  uint64_t get_reg(unsigned int reg_num);
+
   // Execute a number of instructions
   void execute(unsigned int num, bool breakpoint_check);
 
   // Clear breakpoint
   void clear_breakpoint();
 
-  // Set breakpoint at an address
-  void set_breakpoint(uint64_t address);
+  // Set breakpoint at an address. Reaching it is reported unless report is
+  // false.
+  void set_breakpoint(uint64_t address, bool report = true);
+
+  // Get the breakpoint address. Returns false if there is no breakpoint.
+  bool get_breakpoint(uint64_t &address);
 
   // Show privilege level
   // Empty implementation for stage 1, required for stage 2
@@ -115,8 +303,51 @@ public:
 
   uint64_t get_instruction_count();
 
+  // Ticks drive mtime and the event scheduler. One tick passes per retired
+  // instruction, and WFI skips ahead to the next scheduled event.
+  uint64_t get_ticks();
+
+  // Raise or clear a hardware interrupt in mip
+  void set_interrupt_pending(unsigned int bit, bool pending);
+  bool get_interrupt_pending(unsigned int bit);
+
   // Used for Postgraduate assignment. Undergraduate assignment can return 0.
   uint64_t get_cycle_count();
+
+  // Service ecalls on the host instead of trapping, if proxy is not nullptr
+  void set_syscall_proxy(syscall_proxy *proxy);
+
+  // Run intercepted library routines natively, if natives is not nullptr
+  void set_native_routines(native_routines *natives);
+
+  // Stop executing instructions for good, as when the program exits
+  void halt();
+  bool is_halted();
+
+  // Count control flow edges in a bitmap of coverage_size bytes, or stop
+  // counting if bitmap is nullptr. The previous location is reset, as at the
+  // start of a run.
+  static constexpr size_t coverage_size = 1 << 16;
+  void set_coverage(uint8_t *bitmap);
+
+  // Record the instructions executed and the directions of branches, if
+  // code_map is not nullptr
+  void set_code_coverage(code_coverage *code_map);
+
+  // Call a hook with mcause before each exception or interrupt is taken. If
+  // it returns true, the processor halts instead of taking it.
+  void set_exception_hook(std::function<bool(uint64_t cause)> hook);
+
+  // Append the architectural state, the breakpoint and the tick count to a
+  // snapshot as state_size doublewords, or restore them from one.
+  // restore_state returns false if the snapshot is the wrong size.
+  static constexpr size_t state_size =
+      5 + 32 + 2 + 9 + 16 + 16 + 2 + 32 + 8 + 2 * 32 + 2;
+  void save_state(std::vector<uint64_t> &state);
+  bool restore_state(const std::vector<uint64_t> &state);
+
+  // Display TLB and PMP cache statistics
+  void show_statistics();
 };
 
 #endif
@@ -6,13 +6,74 @@
 
 **************************************************************** */
 
+#include <cstdlib>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include "memory.h"
 #include "processor.h"
+#include "scheduler.h"
+#include "uart.h"
+#include "block_device.h"
+#include "plic.h"
+#include "interrupt_replay.h"
+#include "syscall_proxy.h"
+#include "symbols.h"
+#include "native_routines.h"
+#include "checkpoint.h"
+#include "time_travel.h"
+#include "fuzz_harness.h"
+#include "code_coverage.h"
 #include "commands.h"
 
+// Parse a size in bytes with an optional K, M or G suffix
+unsigned long long int parse_size(const char* text) {
+    char* suffix;
+    unsigned long long int size = strtoull(text, &suffix, 0);
+    switch (*suffix) {
+        case 'G': case 'g': size <<= 10; // fall through
+        case 'M': case 'm': size <<= 10; // fall through
+        case 'K': case 'k': size <<= 10;
+    }
+    return size;
+}
+
+// Load a program and fuzz the target at its entry point, with the inputs in
+// each file or directory in turn, or those of an AFL++ fork server client, or
+// else the one on standard input. Returns the number of inputs which crashed.
+unsigned int run_fuzz_harness(memory* main_memory, processor* cpu, symbol_table* symbols,
+                              std::string image, std::string entry, std::string symbol_file,
+                              const std::vector<std::string>& inputs, uint64_t limit) {
+    uint64_t address;
+    if (!main_memory->load_file(image, address)) return 0;
+    cpu->set_pc(address);
+    if (symbol_table::is_elf(image)) symbols->load_file(image);
+    if (!symbol_file.empty()) symbols->load_file(symbol_file);
+    if (!symbols->find(entry, address)) {
+        char* end;
+        address = strtoull(entry.c_str(), &end, 16);
+        if (entry.empty() || *end != '\0') {
+            std::cout << "Unknown symbol" << std::endl;
+            return 0;
+        }
+    }
+    fuzz_harness harness(main_memory, cpu, limit);
+    if (!harness.start(address)) {
+        std::cout << "Fuzz target not reached" << std::endl;
+        return 0;
+    }
+    harness.attach_afl_bitmap();
+    if (!inputs.empty()) {
+        unsigned int crashes = 0;
+        for (const std::string& input : inputs) crashes += harness.run_files(input);
+        return crashes;
+    }
+    if (harness.serve_fork_server()) return 0;
+    return harness.run_files("/dev/stdin");
+}
+
 int main(int argc, char* argv[]) {
 
     // Values of command line options. 
@@ -20,6 +81,37 @@ int main(int argc, char* argv[]) {
     bool verbose = false;
     bool cycle_reporting = false;
     bool stage2 = false;
+    bool statistics_reporting = false;
+    bool pmp = false;
+    bool uart_enabled = false;
+    std::string uart_input;
+    unsigned long int uart_flush_bytes = 4096;
+    unsigned long int uart_flush_ticks = 1000000;
+    std::string disk_file;
+    std::string replay_file;
+    bool proxy_syscalls = false;
+    bool image_cache = false;
+    std::string native_symbols;
+    unsigned long int native_cost = 0;
+    unsigned long long int window_size = 0;
+    unsigned long long int memory_limit = 0;
+    unsigned long long int compress_after = 0;
+    bool deduplicate = false;
+    bool huge_pages = false;
+    std::string checkpoint_file;
+    unsigned long long int checkpoint_interval = 0;
+    unsigned long long int reverse_interval = 0;
+    std::string fuzz_image;
+    std::string fuzz_entry = "LLVMFuzzerTestOneInput";
+    std::string fuzz_symbols;
+    std::vector<std::string> fuzz_inputs;
+    unsigned long long int fuzz_limit = 1000000;
+    unsigned int fuzz_crashes = 0;
+    std::string coverage_file;
+    std::string coverage_lcov;
+    std::string coverage_symbols;
+    std::vector<std::string> coverage_merges;
+    bool limit_exceeded = false;
 
     // memory* main_memory;
     // processor* cpu;
@@ -35,6 +127,64 @@ int main(int argc, char* argv[]) {
 	    cycle_reporting = true;
 	else if (arg == "-s2")  // Stage 2 functionality enabled
 	    stage2 = true;
+	else if (arg == "-pmp")  // Physical memory protection enabled
+	    pmp = true;
+	else if (arg == "-stats")  // Memory system statistics reporting enabled
+	    statistics_reporting = true;
+	else if (arg == "-uart")  // UART console attached
+	    uart_enabled = true;
+	else if (arg == "-uart-in" && i + 1 < argc)  // UART input file or pipe
+	    uart_input = argv[++i];
+	else if (arg == "-uart-flush-bytes" && i + 1 < argc)  // UART output buffer size
+	    uart_flush_bytes = strtoul(argv[++i], nullptr, 0);
+	else if (arg == "-uart-flush-ticks" && i + 1 < argc)  // UART output flush interval
+	    uart_flush_ticks = strtoul(argv[++i], nullptr, 0);
+	else if (arg == "-disk" && i + 1 < argc)  // Block device backing file
+	    disk_file = argv[++i];
+	else if (arg == "-syscalls")  // Service ecalls on the host
+	    proxy_syscalls = true;
+	else if (arg == "-rvimg")  // Binary cache of loaded hex files
+	    image_cache = true;
+	else if (arg == "-native" && i + 1 < argc)  // Symbols of library routines to run natively
+	    native_symbols = argv[++i];
+	else if (arg == "-native-cost" && i + 1 < argc)  // Instructions retired per byte by native routines
+	    native_cost = strtoul(argv[++i], nullptr, 0);
+	else if (arg == "-window" && i + 1 < argc)  // Size of flat guest memory from address 0
+	    window_size = parse_size(argv[++i]);
+	else if (arg == "-mem-limit" && i + 1 < argc)  // Host memory limit for guest pages
+	    memory_limit = parse_size(argv[++i]);
+	else if (arg == "-compress-idle" && i + 1 < argc)  // Compress pages unused for this many ticks
+	    compress_after = strtoull(argv[++i], nullptr, 0);
+	else if (arg == "-dedup")  // Share the storage of identical pages
+	    deduplicate = true;
+	else if (arg == "-hugepages")  // Back dense guest memory with host huge pages
+	    huge_pages = true;
+	else if (arg == "-checkpoint" && i + 1 < argc)  // Incremental checkpoint snapshot file
+	    checkpoint_file = argv[++i];
+	else if (arg == "-checkpoint-every" && i + 1 < argc)  // Ticks between checkpoints
+	    checkpoint_interval = strtoull(argv[++i], nullptr, 0);
+	else if (arg == "-reverse" && i + 1 < argc)  // Ticks between reverse execution checkpoints
+	    reverse_interval = strtoull(argv[++i], nullptr, 0);
+	else if (arg == "-fuzz" && i + 1 < argc)  // Program to fuzz instead of reading commands
+	    fuzz_image = argv[++i];
+	else if (arg == "-fuzz-entry" && i + 1 < argc)  // Symbol or address of the fuzz target
+	    fuzz_entry = argv[++i];
+	else if (arg == "-fuzz-symbols" && i + 1 < argc)  // Symbols of the program to fuzz
+	    fuzz_symbols = argv[++i];
+	else if (arg == "-fuzz-limit" && i + 1 < argc)  // Instructions before a fuzz run hangs
+	    fuzz_limit = strtoull(argv[++i], nullptr, 0);
+	else if (arg == "-fuzz-input" && i + 1 < argc)  // Input file or directory of inputs to run
+	    fuzz_inputs.push_back(argv[++i]);
+	else if (arg == "-coverage" && i + 1 < argc)  // Raw coverage bitmap file to write
+	    coverage_file = argv[++i];
+	else if (arg == "-coverage-merge" && i + 1 < argc)  // Raw coverage bitmaps of earlier runs
+	    coverage_merges.push_back(argv[++i]);
+	else if (arg == "-coverage-lcov" && i + 1 < argc)  // lcov tracefile to write, or - for standard output
+	    coverage_lcov = argv[++i];
+	else if (arg == "-coverage-symbols" && i + 1 < argc)  // Functions for the lcov tracefile
+	    coverage_symbols = argv[++i];
+	else if (arg == "-irq-replay" && i + 1 < argc)  // External interrupt replay script
+	    replay_file = argv[++i];
 	else {
         std::cout << argv[0] << ": Unknown option: " << arg << std::endl;
 	}
@@ -42,10 +192,88 @@ int main(int argc, char* argv[]) {
 
     // main_memory = new memory (verbose);
     // cpu = new processor (main_memory, verbose, stage2);
+    scheduler event_scheduler;
     memory main_memory(verbose);
-    processor cpu(&main_memory, verbose, stage2);
+    main_memory.set_image_cache(image_cache);
+    main_memory.set_limit(memory_limit);
+    main_memory.set_compression(compress_after);
+    main_memory.set_deduplication(deduplicate);
+    main_memory.set_huge_pages(huge_pages);
+    if (window_size > 0 && !main_memory.map_window(window_size)) {
+        std::cout << argv[0] << ": Could not reserve memory window" << std::endl;
+    }
+    uart console(uart_input, uart_flush_bytes, uart_flush_ticks);
+    if (uart_enabled) main_memory.add_device(&console, uart::base, uart::size);
+    processor cpu(&main_memory, &event_scheduler, verbose, stage2, pmp);
+
+    plic interrupt_controller(&cpu);
+
+    // Disk completion interrupts are PLIC source 1
+    block_device disk(&main_memory, [&interrupt_controller](bool level) { interrupt_controller.set_level(1, level); }, disk_file);
+    if (disk.is_open()) main_memory.add_device(&disk, block_device::base, block_device::size);
+
+    // The PLIC's registers are only mapped over memory when something drives its sources
+    if (disk.is_open() || !replay_file.empty()) interrupt_controller.attach(&main_memory);
+
+    interrupt_replay replay(&cpu, &event_scheduler, &interrupt_controller);
+    if (!replay_file.empty()) replay.load_file(replay_file);
+
+    syscall_proxy syscalls(&cpu, &main_memory);
+    if (proxy_syscalls) cpu.set_syscall_proxy(&syscalls);
+
+    symbol_table symbols;
+    native_routines natives(&cpu, &main_memory, native_cost);
+    if (!native_symbols.empty() && symbols.load_file(native_symbols) && natives.add_symbols(symbols) > 0) {
+        cpu.set_native_routines(&natives);
+    }
+
+    std::unique_ptr<checkpointer> checkpoints;
+    if (!checkpoint_file.empty() && checkpoint_interval > 0) {
+        checkpoints.reset(new checkpointer(&main_memory, &cpu, &event_scheduler, checkpoint_file, checkpoint_interval));
+    }
+
+    // Replaying history would repeat the host side effects of proxied
+    // system calls and native routines
+    if (reverse_interval > 0 && (proxy_syscalls || !native_symbols.empty())) {
+        std::cout << argv[0] << ": -reverse cannot be used with -syscalls or -native" << std::endl;
+        reverse_interval = 0;
+    }
+    std::unique_ptr<time_travel> history;
+    if (reverse_interval > 0) {
+        history.reset(new time_travel(&main_memory, &cpu, &event_scheduler, reverse_interval));
+    }
 
-    interpret_commands(&main_memory, &cpu, verbose);
+    std::unique_ptr<code_coverage> code_map;
+    if (!coverage_file.empty() || !coverage_lcov.empty()) {
+        code_map.reset(new code_coverage);
+        for (const std::string& file_name : coverage_merges) {
+            if (!code_map->merge(file_name)) std::cout << "Failed to read coverage file " << file_name << std::endl;
+        }
+        if (!coverage_symbols.empty()) symbols.load_file(coverage_symbols);
+        cpu.set_code_coverage(code_map.get());
+    }
+
+    try {
+        if (!fuzz_image.empty()) {
+            fuzz_crashes = run_fuzz_harness(&main_memory, &cpu, &symbols, fuzz_image, fuzz_entry, fuzz_symbols, fuzz_inputs, fuzz_limit);
+        } else {
+            interpret_commands(&main_memory, &cpu, &symbols, history.get(), verbose);
+        }
+    } catch (const memory::limit_exceeded& error) {
+        std::cout << "Error: " << error.what() << std::endl;
+        limit_exceeded = true;
+    }
+
+    if (code_map) {
+        cpu.set_code_coverage(nullptr);
+        if (!coverage_file.empty() && !code_map->save(coverage_file)) {
+            std::cout << "Failed to write coverage file" << std::endl;
+        }
+        std::string source_name = coverage_symbols.empty() ? "program" : coverage_symbols;
+        if (!coverage_lcov.empty() && !code_map->write_lcov(coverage_lcov, source_name, symbols, &main_memory)) {
+            std::cout << "Failed to write lcov file" << std::endl;
+        }
+    }
 
     // Report final statistics
 
@@ -60,4 +288,14 @@ int main(int argc, char* argv[]) {
 
     std::cout << "CPU cycle count: " << std::dec << cpu_cycle_count << std::endl;
     }
+
+    if (statistics_reporting) {
+	cpu.show_statistics();
+	main_memory.show_statistics();
+    }
+
+    if (limit_exceeded || fuzz_crashes > 0) return EXIT_FAILURE;
+
+    // Pass on the exit code of a program run with the system call proxy
+    if (syscalls.has_exited()) return syscalls.get_exit_code();
 }
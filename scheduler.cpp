@@ -0,0 +1,50 @@
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class members for the event scheduler
+
+**************************************************************** */
+
+#include "scheduler.h"
+
+constexpr uint64_t scheduler::never;
+
+// Constructor
+scheduler::scheduler() : next_id(0), next(never) {}
+
+uint64_t scheduler::schedule(uint64_t time, action event_action) {
+  uint64_t id = this->next_id++;
+  this->actions[id] = event_action;
+  this->queue.push({time, id});
+  if (time < this->next)
+    this->next = time;
+  return id;
+}
+
+void scheduler::cancel(uint64_t id) {
+  this->actions.erase(id);
+  update_next();
+}
+
+void scheduler::run(uint64_t now) {
+  while (!this->queue.empty() && this->queue.top().time <= now) {
+    event due = this->queue.top();
+    this->queue.pop();
+    auto found = this->actions.find(due.id);
+    if (found == this->actions.end())
+      continue; // Cancelled
+    action due_action = found->second;
+    this->actions.erase(found);
+    due_action(due.time);
+  }
+  update_next();
+}
+
+void scheduler::update_next() {
+  while (!this->queue.empty() &&
+         this->actions.find(this->queue.top().id) == this->actions.end()) {
+    this->queue.pop();
+  }
+  this->next = this->queue.empty() ? never : this->queue.top().time;
+}
@@ -0,0 +1,65 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class for the event scheduler
+
+**************************************************************** */
+
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+// Timed events for devices, keyed by processor ticks. A tick passes for every
+// retired instruction, and WFI skips ticks ahead to the next event. The
+// processor only compares its tick count with next_event() each instruction,
+// and calls run() once it is reached.
+class scheduler {
+
+public:
+  typedef std::function<void(uint64_t time)> action;
+
+  static constexpr uint64_t never = ~0ULL;
+
+  // Constructor
+  scheduler();
+
+  // Schedule an action to run once the tick count reaches time. Returns an
+  // identifier which can be used to cancel the event.
+  uint64_t schedule(uint64_t time, action event_action);
+
+  // Cancel a scheduled event. Cancelling an event which has already run has
+  // no effect.
+  void cancel(uint64_t id);
+
+  // Run every event due at or before now in time order, passing each action
+  // the time it was scheduled for. Actions may schedule further events.
+  void run(uint64_t now);
+
+  // Time of the earliest scheduled event, or never if there are none
+  uint64_t next_event() const { return next; }
+
+private:
+  struct event {
+    uint64_t time;
+    uint64_t id;
+    bool operator>(const event &other) const {
+      return time != other.time ? time > other.time : id > other.id;
+    }
+  };
+
+  std::priority_queue<event, std::vector<event>, std::greater<event>> queue;
+  std::unordered_map<uint64_t, action> actions;
+  uint64_t next_id;
+  uint64_t next;
+
+  // Discard cancelled events from the head of the queue and update next
+  void update_next();
+};
+
+#endif
@@ -0,0 +1,38 @@
+# CLINT machine timer interrupt, with WFI skipping ahead to mtimecmp
+
+csr 305 = 4000  # mtvec, direct mode
+m 4000 = 0000001300000013  # nop; nop
+
+m 1000 = 105000730020b023  # sd x2, 0(x1); wfi
+m 1008 = 0000001300000013  # nop; nop
+
+x1 = 2004000  # mtimecmp
+x2 = 100
+csr 304 = 80  # mie.mtie = 1
+csr 300 = 0000000200000008  # mstatus.mie = 1
+
+pc = 1000
+. 2
+
+pc       # expect 0000000000001008
+csr c01  # time, expect 0000000000000100
+csr c02  # instret, expect 0000000000000002
+
+.
+
+pc       # expect 0000000000004004
+csr 342  # mcause, expect 8000000000000007
+csr 341  # mepc, expect 0000000000001008
+csr 344  # mip, expect 0000000000000080
+
+################
+
+# Writing mtimecmp beyond mtime clears the pending interrupt
+
+x2 = ffffffffffffffff
+m 4000 = 000000130020b023  # sd x2, 0(x1); nop
+pc = 4000
+.
+
+csr 344  # mip, expect 0000000000000000
+m 2004000  # mtimecmp, expect ffffffffffffffff
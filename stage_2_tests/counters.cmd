@@ -0,0 +1,56 @@
+# Hardware performance counters
+
+csr 305 = 4000  # mtvec, direct mode
+
+m 1000 = 0000001300000013  # nop; nop
+m 1008 = c0002373c02022f3  # rdinstret x5; rdcycle x6
+m 1010 = 000000130000b103  # ld x2, 0(x1); nop
+
+csr b00 = 0  # mcycle
+csr b02 = 0  # minstret
+
+pc = 1000
+. 4
+
+x5       # expect 0000000000000002
+x6       # expect 0000000000000003
+csr b02  # minstret, expect 0000000000000004
+
+################
+
+csr 320 = 0000000000000004  # mcountinhibit.ir = 1
+pc = 1000
+. 3
+
+x5       # expect 0000000000000004
+csr b00  # mcycle, expect 0000000000000007
+
+csr 320 = 0  # mcountinhibit
+
+################
+
+csr 323 = 0000000000000001  # mhpmevent3, loads
+csr b03 = 0000000000000010  # mhpmcounter3
+x1 = 0
+pc = 1010
+.
+
+csr b03  # expect 0000000000000011
+csr c03  # expect 0000000000000011
+
+################
+
+prv = 0
+pc = 100c
+.
+
+pc       # expect 4000
+csr 342  # mcause, expect 0000000000000002 (illegal instruction)
+
+csr 306 = 0000000000000001  # mcounteren.cy = 1
+prv = 0
+pc = 100c
+.
+
+pc       # expect 1010
+x6       # expect 000000000000000a
@@ -2,15 +2,15 @@
 
 csr 000
 csr 040
-csr c00
-csr c02
+csr c80
+csr c82
 csr 100
 csr 140
 csr 302
 csr 302
-csr 306
+csr 303
 csr 3a0
-csr b03
+csr b83
 csr 7a0
 csr 7b0
 csr fff
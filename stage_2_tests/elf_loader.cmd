@@ -0,0 +1,16 @@
+# ELF executable loading, with a breakpoint at a symbol. The first segment of
+# elf_loader_invalid.elf is valid and the second runs past the end of the file.
+
+l "elf_loader_invalid.elf"  # expect "Invalid ELF file"
+m 1000   # expect 0000000000000000
+
+m 1018 = ffffffffffffffff  # in .bss, zeroed by the load
+l "elf_loader.elf"
+
+pc       # expect 0000000000001000
+m 1000   # expect 0000001300000013
+m 1018   # expect 0000000000000000
+
+b main
+. 10     # expect "Breakpoint reached at 0000000000001004"
+b nonexistent  # expect "Unknown symbol"
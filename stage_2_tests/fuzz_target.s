@@ -0,0 +1,49 @@
+# Target for the fuzz harness, run by fuzz_harness.cmd-fuzz.
+# The target checks that the pages written by earlier runs were restored:
+# the counter it increments is always 6, and the page it writes is zero.
+# Linked with -Ttext 0x00000000 -Tdata 0x00011000.
+
+        .text
+
+        .globl  _start
+
+        .org    0x00000000
+_start:
+        lui     sp, 0x80
+        lui     a0, 0x10                # input buffer
+        li      a1, 16                  # and its size
+        jal     ra, LLVMFuzzerTestOneInput
+1:      nop
+        j       1b
+
+        .org    0x00000020
+LLVMFuzzerTestOneInput:
+        lui     t0, 0x11
+        ld      t1, 0(t0)               # counter, 5 when loaded
+        addi    t1, t1, 1
+        sd      t1, 0(t0)
+        li      t2, 6
+        bne     t1, t2, crash
+        lui     t6, 0x12
+        ld      t5, 0(t6)               # page which starts out zero
+        bnez    t5, crash
+        sd      t6, 0(t6)
+        beqz    a1, return
+        lbu     t3, 0(a0)
+        li      t4, 'X'
+        beq     t3, t4, crash
+        li      t4, 'H'
+        beq     t3, t4, hang
+return:
+        ret
+crash:
+        .word   0                       # illegal instruction
+hang:
+        nop
+        j       hang
+
+        .data
+
+        .org    0x00000000
+counter:
+        .dword  5
@@ -0,0 +1,3 @@
+# Hex records with incorrect checksums are rejected
+
+l "hex_checksum.hex"  # expect "Input line 2 has an incorrect checksum"
@@ -0,0 +1,32 @@
+# A snapshot saves registers, CSRs, the instruction count and memory, and
+# restoring it undoes everything done since
+
+m 1000 = ffdff06f00108093  # addi x1, x1, 1; jal x0, -4
+m 40000000 = 0123456789abcdef
+x5 = 55
+csr 340 = 1234
+pc = 1000
+. 10
+save "/tmp/rv64sim_snapshot_test.rvsnap"
+x1              # expect 0000000000000005
+m 40000000 = 0
+m 50000000 = 77
+x5 = 0
+csr 340 = 0
+. 7
+restore "/tmp/rv64sim_snapshot_test.rvsnap"
+x1              # expect 0000000000000005
+x5              # expect 0000000000000055
+pc              # expect 0000000000001000
+csr 340         # expect 0000000000001234
+csr b02         # expect 000000000000000a
+m 40000000      # expect 0123456789abcdef
+m 50000000      # expect 0000000000000000
+m 1000          # expect ffdff06f00108093
+. 2
+x1              # expect 0000000000000006
+m 40000000 = 1
+m 40000000      # expect 0000000000000001
+restore "/tmp/rv64sim_snapshot_test.rvsnap"
+m 40000000      # expect 0123456789abcdef
+restore "/tmp/rv64sim_no_such_snapshot.rvsnap"  # expect Failed to restore snapshot
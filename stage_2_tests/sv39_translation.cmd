@@ -0,0 +1,56 @@
+# Sv39 address translation and page faults in user mode
+
+csr 305 = 4000  # mtvec, direct mode
+
+# Page table: root at 10000, second level at 11000, leaf level at 12000
+m 10000 = 0000000000004401  # vpn[2] = 0 -> 11000, V
+m 11000 = 0000000000004801  # vpn[1] = 0 -> 12000, V
+m 12000 = 000000000000085b  # 0000 -> 2000, V R X U A
+m 12008 = 0000000000000c53  # 1000 -> 3000, V R U A (read only)
+
+m 2000 = 0020b4230000b103  # ld x2, 0(x1); sd x2, 8(x1)
+m 3000 = 1122334455667788
+m 4000 = 0000001312000073  # sfence.vma; nop
+
+csr 180 = 8000000000000010  # satp, Sv39 with root at 10000
+
+################
+
+x1 = 1000
+prv = 0
+pc = 0
+.
+
+pc       # expect 0000000000000004
+x2       # expect 1122334455667788
+
+.
+
+pc       # expect 4000
+prv      # expect 3
+csr 342  # mcause, expect 000000000000000f (store page fault)
+csr 341  # mepc, expect 0000000000000004
+csr 343  # mtval, expect 0000000000001008
+m 3008   # expect 0000000000000000
+
+################
+
+m 12008 = 0000000000000853  # 1000 -> 2000, V R U A
+.        # sfence.vma
+
+prv = 0
+pc = 0
+.
+
+x2       # expect 0020b4230000b103
+
+################
+
+prv = 0
+pc = 5000
+.
+
+pc       # expect 4000
+csr 342  # mcause, expect 000000000000000c (instruction page fault)
+csr 341  # mepc, expect 0000000000005000
+csr 343  # mtval, expect 0000000000005000
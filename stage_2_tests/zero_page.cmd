@@ -0,0 +1,12 @@
+# Reads of untouched memory come from the shared zero page, which is
+# replaced when the page is first written
+
+m 1000 = 0001330300013283  # ld x5, 0(x2); ld x6, 0(x2)
+x2 = 40000000
+pc = 1000
+. 1
+x5              # expect 0000000000000000
+m 40000000 = 0000000000001234
+. 1
+x6              # expect 0000000000001234
+m 40000008      # expect 0000000000000000
@@ -0,0 +1,152 @@
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class members for a table of program symbols
+
+**************************************************************** */
+
+#include <algorithm>
+#include <elf.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include "symbols.h"
+
+bool symbol_table::is_elf(std::string file_name) {
+  std::ifstream input_file(file_name, std::ios::binary);
+  char magic[SELFMAG];
+  return input_file.read(magic, SELFMAG) &&
+         std::string(magic, SELFMAG) == ELFMAG;
+}
+
+bool symbol_table::load_file(std::string file_name) {
+  std::ifstream input_file(file_name, std::ios::binary);
+  if (!input_file.is_open()) {
+    std::cout << "Failed to open symbol file" << std::endl;
+    return false;
+  }
+  char magic[SELFMAG];
+  if (input_file.read(magic, SELFMAG) &&
+      std::string(magic, SELFMAG) == ELFMAG) {
+    return load_elf(input_file);
+  }
+  input_file.clear();
+  input_file.seekg(0);
+  return load_dump(input_file);
+}
+
+// Symbols come from the first symbol table section and its string table
+bool symbol_table::load_elf(std::ifstream &input_file) {
+  Elf64_Ehdr header;
+  input_file.seekg(0);
+  if (!input_file.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+      header.e_ident[EI_CLASS] != ELFCLASS64 ||
+      header.e_ident[EI_DATA] != ELFDATA2LSB ||
+      header.e_shentsize != sizeof(Elf64_Shdr)) {
+    std::cout << "Unsupported ELF file" << std::endl;
+    return false;
+  }
+  std::vector<Elf64_Shdr> sections(header.e_shnum);
+  input_file.seekg(header.e_shoff);
+  input_file.read(reinterpret_cast<char *>(sections.data()),
+                  sections.size() * sizeof(Elf64_Shdr));
+  for (const Elf64_Shdr &section : sections) {
+    if (section.sh_type != SHT_SYMTAB || section.sh_link >= sections.size())
+      continue;
+    const Elf64_Shdr &strings = sections[section.sh_link];
+    std::vector<char> names(strings.sh_size + 1, '\0');
+    input_file.seekg(strings.sh_offset);
+    input_file.read(names.data(), strings.sh_size);
+    std::vector<Elf64_Sym> symbols(section.sh_size / sizeof(Elf64_Sym));
+    input_file.seekg(section.sh_offset);
+    input_file.read(reinterpret_cast<char *>(symbols.data()),
+                    symbols.size() * sizeof(Elf64_Sym));
+    if (!input_file) {
+      std::cout << "Truncated ELF file" << std::endl;
+      return false;
+    }
+    for (const Elf64_Sym &symbol : symbols) {
+      unsigned char type = ELF64_ST_TYPE(symbol.st_info);
+      if ((type == STT_FUNC || type == STT_OBJECT || type == STT_NOTYPE) &&
+          symbol.st_shndx != SHN_UNDEF && symbol.st_name < strings.sh_size &&
+          names[symbol.st_name] != '\0') {
+        add(&names[symbol.st_name], symbol.st_value);
+        if (type == STT_FUNC && symbol.st_size > 0)
+          this->function_list.push_back(
+              {symbol.st_value, symbol.st_size, &names[symbol.st_name]});
+      }
+    }
+    return true;
+  }
+  std::cout << "ELF file has no symbol table" << std::endl;
+  return false;
+}
+
+// Every label of a disassembly starts a function, which ends after the last
+// instruction before the next label
+bool symbol_table::load_dump(std::ifstream &input_file) {
+  std::string line;
+  bool labelled = false;
+  while (std::getline(input_file, line)) {
+    if (!line.empty() && line.back() == '\r')
+      line.pop_back();
+    // Instructions look like "  25c:\t00113423          \tsd\tra,8(sp)"
+    size_t colon = line.find(":\t");
+    if (labelled && colon != std::string::npos && colon > 0 &&
+        line.find_first_not_of(" ") < colon &&
+        line.find_first_not_of(" 0123456789abcdef") == colon) {
+      uint64_t address;
+      std::istringstream(line.substr(0, colon)) >> std::hex >> address;
+      size_t digits = line.find_first_of(" \t", colon + 2) - (colon + 2);
+      function &current = this->function_list.back();
+      current.size = address + digits / 2 - current.address;
+      continue;
+    }
+    // Labels look like "0000000000000258 <exception_handler>:"
+    size_t open = line.find(" <");
+    if (open == 0 || open == std::string::npos ||
+        line.compare(line.size() - 2, 2, ">:") != 0 ||
+        line.find_first_not_of("0123456789abcdef") != open)
+      continue;
+    uint64_t address;
+    std::istringstream(line.substr(0, open)) >> std::hex >> address;
+    std::string name = line.substr(open + 2, line.size() - open - 4);
+    add(name, address);
+    this->function_list.push_back({address, 0, name});
+    labelled = true;
+  }
+  return true;
+}
+
+void symbol_table::add(std::string name, uint64_t address) {
+  this->addresses[name] = address;
+}
+
+bool symbol_table::find(std::string name, uint64_t &address) const {
+  auto symbol = this->addresses.find(name);
+  if (symbol == this->addresses.end())
+    return false;
+  address = symbol->second;
+  return true;
+}
+
+void symbol_table::functions(std::vector<function> &list) const {
+  list.clear();
+  for (const function &entry : this->function_list) {
+    if (entry.size > 0)
+      list.push_back(entry);
+  }
+  std::sort(list.begin(), list.end(),
+            [](const function &a, const function &b) {
+              return a.address < b.address ||
+                     (a.address == b.address && a.name < b.name);
+            });
+  list.erase(std::unique(list.begin(), list.end(),
+                         [](const function &a, const function &b) {
+                           return a.address == b.address && a.name == b.name;
+                         }),
+             list.end());
+}
@@ -0,0 +1,55 @@
+#ifndef SYMBOLS_H
+#define SYMBOLS_H
+
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class for a table of program symbols
+
+**************************************************************** */
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class symbol_table {
+
+public:
+  struct function {
+    uint64_t address;
+    uint64_t size;
+    std::string name;
+  };
+
+private:
+  std::unordered_map<std::string, uint64_t> addresses;
+  std::vector<function> function_list;
+
+  bool load_elf(std::ifstream &input_file);
+  bool load_dump(std::ifstream &input_file);
+
+public:
+  // Read function and object symbols from an ELF file's symbol table, or the
+  // "<address> <name>:" labels of an objdump disassembly. Return true if the
+  // file was read without error, or false otherwise.
+  bool load_file(std::string file_name);
+
+  // Returns true if a file starts with the ELF magic number
+  static bool is_elf(std::string file_name);
+
+  // Add or replace a symbol
+  void add(std::string name, uint64_t address);
+
+  // Find the address of a symbol. Return false if there is no such symbol.
+  bool find(std::string name, uint64_t &address) const;
+
+  // Find the functions read from files, in order of address. The size of a
+  // function is taken from the ELF symbol, or from a disassembly as the
+  // extent of the instructions following its label.
+  void functions(std::vector<function> &list) const;
+};
+
+#endif
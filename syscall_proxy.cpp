@@ -0,0 +1,222 @@
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class members for servicing guest system calls on the host
+
+**************************************************************** */
+
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "processor.h"
+#include "syscall_proxy.h"
+
+// RISC-V Linux system call numbers
+static constexpr uint64_t sys_openat_number = 56;
+static constexpr uint64_t sys_close_number = 57;
+static constexpr uint64_t sys_read_number = 63;
+static constexpr uint64_t sys_write_number = 64;
+static constexpr uint64_t sys_exit_number = 93;
+static constexpr uint64_t sys_exit_group_number = 94;
+static constexpr uint64_t sys_gettimeofday_number = 169;
+static constexpr uint64_t sys_brk_number = 214;
+static constexpr uint64_t sys_open_number = 1024; // newlib only
+
+// Guest open flags, as in the generic Linux ABI
+static constexpr uint64_t guest_o_accmode = 0x003;
+static constexpr uint64_t guest_o_creat = 0x040;
+static constexpr uint64_t guest_o_excl = 0x080;
+static constexpr uint64_t guest_o_trunc = 0x200;
+static constexpr uint64_t guest_o_append = 0x400;
+
+// Largest transfer through a host buffer at a time
+static constexpr uint64_t chunk_size = 1 << 20;
+
+// Registers a0-a5 and a7
+static constexpr unsigned int a0 = 10;
+static constexpr unsigned int a7 = 17;
+
+// Constructor
+syscall_proxy::syscall_proxy(processor *cpu, memory *main_memory)
+    : cpu(cpu), main_memory(main_memory), files({0, 1, 2}), program_break(0),
+      exited(false), exit_code(0) {}
+
+syscall_proxy::~syscall_proxy() {
+  for (size_t fd = 3; fd < this->files.size(); fd++) {
+    if (this->files[fd] >= 0)
+      close(this->files[fd]);
+  }
+}
+
+void syscall_proxy::handle() {
+  uint64_t args[6];
+  for (unsigned int i = 0; i < 6; i++)
+    args[i] = this->cpu->get_reg(a0 + i);
+  int64_t result;
+  switch (this->cpu->get_reg(a7)) {
+  case sys_read_number:
+    result = sys_read(args[0], args[1], args[2]);
+    break;
+  case sys_write_number:
+    result = sys_write(args[0], args[1], args[2]);
+    break;
+  case sys_openat_number:
+    // Relative paths are opened from the simulator's working directory
+    result = sys_open(args[1], args[2], args[3]);
+    break;
+  case sys_open_number:
+    result = sys_open(args[0], args[1], args[2]);
+    break;
+  case sys_close_number:
+    result = sys_close(args[0]);
+    break;
+  case sys_exit_number:
+  case sys_exit_group_number:
+    result = sys_exit(args[0]);
+    break;
+  case sys_brk_number:
+    result = sys_brk(args[0]);
+    break;
+  case sys_gettimeofday_number:
+    result = sys_gettimeofday(args[0]);
+    break;
+  default:
+    result = -ENOSYS;
+    break;
+  }
+  this->cpu->set_reg(a0, result);
+}
+
+int syscall_proxy::host_file(uint64_t guest_fd) {
+  return guest_fd < this->files.size() ? this->files[guest_fd] : -1;
+}
+
+std::string syscall_proxy::read_string(uint64_t address) {
+  std::string result;
+  uint8_t c;
+  for (this->main_memory->read_block(address++, &c, 1); c != 0;
+       this->main_memory->read_block(address++, &c, 1))
+    result.push_back(c);
+  return result;
+}
+
+int64_t syscall_proxy::sys_read(uint64_t fd, uint64_t buffer, uint64_t count) {
+  int host_fd = host_file(fd);
+  if (host_fd < 0)
+    return -EBADF;
+  // Reads may be short, so one chunk is enough
+  std::vector<uint8_t> data(std::min(count, chunk_size));
+  ssize_t length = read(host_fd, data.data(), data.size());
+  if (length < 0)
+    return -errno;
+  this->main_memory->write_block(buffer, data.data(), length);
+  return length;
+}
+
+// Standard output and error go through the simulator's own streams so they
+// stay in order with its output
+int64_t syscall_proxy::sys_write(uint64_t fd, uint64_t buffer,
+                                 uint64_t count) {
+  int host_fd = host_file(fd);
+  if (host_fd < 0)
+    return -EBADF;
+  std::vector<uint8_t> data(std::min(count, chunk_size));
+  const char *bytes = reinterpret_cast<const char *>(data.data());
+  uint64_t written = 0;
+  while (written < count) {
+    uint64_t length = std::min(count - written, chunk_size);
+    this->main_memory->read_block(buffer + written, data.data(), length);
+    if (host_fd == 1 || host_fd == 2) {
+      std::ostream &stream = host_fd == 1 ? std::cout : std::cerr;
+      stream.write(bytes, length);
+      stream.flush();
+    } else {
+      ssize_t result = write(host_fd, bytes, length);
+      if (result < 0)
+        return written ? written : -errno;
+      length = result;
+    }
+    written += length;
+  }
+  return written;
+}
+
+int64_t syscall_proxy::sys_open(uint64_t path, uint64_t flags, uint64_t mode) {
+  int host_flags = 0;
+  switch (flags & guest_o_accmode) {
+  case 0:
+    host_flags = O_RDONLY;
+    break;
+  case 1:
+    host_flags = O_WRONLY;
+    break;
+  default:
+    host_flags = O_RDWR;
+    break;
+  }
+  if (flags & guest_o_creat)
+    host_flags |= O_CREAT;
+  if (flags & guest_o_excl)
+    host_flags |= O_EXCL;
+  if (flags & guest_o_trunc)
+    host_flags |= O_TRUNC;
+  if (flags & guest_o_append)
+    host_flags |= O_APPEND;
+  int host_fd = open(read_string(path).c_str(), host_flags, mode);
+  if (host_fd < 0)
+    return -errno;
+  for (size_t fd = 3; fd < this->files.size(); fd++) {
+    if (this->files[fd] < 0) {
+      this->files[fd] = host_fd;
+      return fd;
+    }
+  }
+  this->files.push_back(host_fd);
+  return this->files.size() - 1;
+}
+
+int64_t syscall_proxy::sys_close(uint64_t fd) {
+  int host_fd = host_file(fd);
+  if (host_fd < 0)
+    return -EBADF;
+  this->files[fd] = -1;
+  if (fd < 3)
+    return 0;
+  return close(host_fd) < 0 ? -errno : 0;
+}
+
+int64_t syscall_proxy::sys_exit(uint64_t code) {
+  this->exited = true;
+  this->exit_code = static_cast<int>(code);
+  std::cout << "Program exited with code " << std::dec << this->exit_code
+            << std::endl;
+  this->cpu->halt();
+  return code;
+}
+
+// Memory is allocated on demand, so any break above the image is accepted.
+// Other requests, such as brk(0), return the current break, which starts at
+// the end of the image rounded up to a doubleword.
+int64_t syscall_proxy::sys_brk(uint64_t address) {
+  uint64_t start = (this->main_memory->get_image_end() + 7) & ~0x7ULL;
+  if (this->program_break == 0)
+    this->program_break = start;
+  if (address >= start)
+    this->program_break = address;
+  return this->program_break;
+}
+
+int64_t syscall_proxy::sys_gettimeofday(uint64_t tv) {
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+  uint64_t guest_tv[2] = {static_cast<uint64_t>(now.tv_sec),
+                          static_cast<uint64_t>(now.tv_usec)};
+  this->main_memory->write_block(tv, reinterpret_cast<uint8_t *>(guest_tv),
+                                 sizeof(guest_tv));
+  return 0;
+}
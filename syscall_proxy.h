@@ -0,0 +1,65 @@
+#ifndef SYSCALL_PROXY_H
+#define SYSCALL_PROXY_H
+
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class for servicing guest system calls on the host
+
+**************************************************************** */
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "memory.h"
+
+class processor;
+
+// Services ecalls using the RISC-V Linux system call numbers in a7, with
+// arguments in a0-a5 and the result, or a negated errno, returned in a0.
+// Guest buffers are copied to and from memory in bulk, and are taken to be
+// physical addresses.
+class syscall_proxy {
+
+public:
+  // Constructor
+  syscall_proxy(processor *cpu, memory *main_memory);
+  ~syscall_proxy();
+
+  // Service the system call requested by the registers
+  void handle();
+
+  // Returns true once the program has called exit, with its exit code
+  bool has_exited() { return this->exited; }
+  int get_exit_code() { return this->exit_code; }
+
+private:
+  // We do not have ownership over these objects! Do not free them!
+  processor *cpu;
+  memory *main_memory;
+
+  // Host file descriptors, indexed by guest file descriptor, or -1 if closed.
+  // The standard streams are shared with the simulator and never closed.
+  std::vector<int> files;
+
+  // Program break, set from the end of the loaded image on first use
+  uint64_t program_break;
+
+  bool exited;
+  int exit_code;
+
+  int host_file(uint64_t guest_fd);
+  std::string read_string(uint64_t address);
+
+  int64_t sys_read(uint64_t fd, uint64_t buffer, uint64_t count);
+  int64_t sys_write(uint64_t fd, uint64_t buffer, uint64_t count);
+  int64_t sys_open(uint64_t path, uint64_t flags, uint64_t mode);
+  int64_t sys_close(uint64_t fd);
+  int64_t sys_exit(uint64_t code);
+  int64_t sys_brk(uint64_t address);
+  int64_t sys_gettimeofday(uint64_t tv);
+};
+
+#endif
@@ -0,0 +1,262 @@
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class members for reverse execution
+
+**************************************************************** */
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+
+#include "processor.h"
+#include "time_travel.h"
+
+// Calls to execute in a row which may retire no instructions, as when every
+// instruction traps, before executing forward gives up
+static constexpr unsigned int max_stalled = 1000;
+
+// Constructor
+time_travel::time_travel(memory *main_memory, processor *cpu,
+                         scheduler *events, uint64_t interval)
+    : main_memory(main_memory), cpu(cpu), events(events), interval(interval),
+      current(0), generation(0), at_end(true), replaying(false),
+      event_scheduled(false), checkpoint_event(0) {
+  this->main_memory->track_dirty_pages();
+  start_history();
+  schedule_checkpoint();
+}
+
+// Checkpoints are only taken at the end of history, and the next is always
+// an interval from the current tick count, which moves back with the machine
+void time_travel::schedule_checkpoint() {
+  if (this->event_scheduled)
+    this->events->cancel(this->checkpoint_event);
+  this->event_scheduled = true;
+  this->checkpoint_event = this->events->schedule(
+      this->cpu->get_ticks() + this->interval, [this](uint64_t) {
+        this->event_scheduled = false;
+        if (this->at_end && !this->replaying)
+          take_checkpoint();
+        schedule_checkpoint();
+      });
+}
+
+// The first checkpoint holds every stored page
+void time_travel::start_history() {
+  checkpoint first;
+  first.instruction_count = this->cpu->get_instruction_count();
+  this->cpu->save_state(first.state);
+  this->main_memory->stored_pages(first.keys);
+  this->main_memory->copy_pages(first.keys, first.contents);
+  this->generation = this->main_memory->start_dirty_generation();
+  this->checkpoints.clear();
+  this->checkpoints.push_back(std::move(first));
+  this->current = 0;
+}
+
+// Only the last of several checkpoints at the same instruction count can be
+// moved to, so a checkpoint replaces one at its count, adding its pages
+void time_travel::take_checkpoint() {
+  checkpoint next;
+  next.instruction_count = this->cpu->get_instruction_count();
+  this->cpu->save_state(next.state);
+  this->main_memory->dirty_pages(this->generation, next.keys);
+  checkpoint &last = this->checkpoints.back();
+  if (last.instruction_count == next.instruction_count) {
+    std::vector<uint64_t> keys;
+    std::set_union(last.keys.begin(), last.keys.end(), next.keys.begin(),
+                   next.keys.end(), std::back_inserter(keys));
+    next.keys.swap(keys);
+    this->checkpoints.pop_back();
+  }
+  this->main_memory->copy_pages(next.keys, next.contents);
+  this->generation = this->main_memory->start_dirty_generation();
+  this->checkpoints.push_back(std::move(next));
+  this->current = this->checkpoints.size() - 1;
+}
+
+void time_travel::begin_change() {
+  if (this->at_end)
+    return;
+  this->checkpoints.resize(this->current + 1);
+  this->at_end = true;
+  schedule_checkpoint();
+}
+
+void time_travel::end_change(bool command) {
+  if (this->main_memory->replaced_since(this->generation))
+    start_history();
+  else if (command)
+    take_checkpoint();
+}
+
+// The end of history is saved before moving away from it, so that it can be
+// returned to exactly
+void time_travel::leave_end() {
+  if (!this->at_end)
+    return;
+  take_checkpoint();
+  this->at_end = false;
+}
+
+// Pages can only differ from the checkpoint if they have been written since
+// the current checkpoint, or by checkpoints between the two. Each is restored
+// from the last checkpoint up to the one restored which holds it, or zeroed
+// if there is none. The breakpoint is left as it is.
+void time_travel::restore(size_t index) {
+  std::vector<uint64_t> keys;
+  this->main_memory->dirty_pages(this->generation, keys);
+  size_t low = std::min(index, this->current);
+  size_t high = std::max(index, this->current);
+  for (size_t i = low + 1; i <= high; i++) {
+    const std::vector<uint64_t> &written = this->checkpoints[i].keys;
+    keys.insert(keys.end(), written.begin(), written.end());
+  }
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+  uint64_t page_size = 1ULL << memory::page_bits;
+  for (uint64_t key : keys) {
+    const uint8_t *data = nullptr;
+    for (size_t i = index + 1; data == nullptr && i-- > 0;) {
+      const checkpoint &saved = this->checkpoints[i];
+      auto found = std::lower_bound(saved.keys.begin(), saved.keys.end(), key);
+      if (found != saved.keys.end() && *found == key)
+        data = saved.contents.data() +
+               ((found - saved.keys.begin()) << memory::page_bits);
+    }
+    if (data)
+      this->main_memory->write_block(key << memory::page_bits, data,
+                                     page_size);
+    else
+      this->main_memory->clear_block(key << memory::page_bits, page_size);
+  }
+
+  uint64_t breakpoint;
+  bool has_breakpoint = this->cpu->get_breakpoint(breakpoint);
+  this->cpu->restore_state(this->checkpoints[index].state);
+  if (has_breakpoint)
+    this->cpu->set_breakpoint(breakpoint);
+  else
+    this->cpu->clear_breakpoint();
+  this->current = index;
+  this->generation = this->main_memory->start_dirty_generation();
+}
+
+// Index of the last checkpoint at or before an instruction count
+size_t time_travel::find_checkpoint(uint64_t count) {
+  auto after = std::upper_bound(
+      this->checkpoints.begin(), this->checkpoints.end(), count,
+      [](uint64_t count, const checkpoint &saved) {
+        return count < saved.instruction_count;
+      });
+  return after == this->checkpoints.begin() ? 0
+                                            : after - this->checkpoints.begin() - 1;
+}
+
+// Execute until an instruction count is reached. Instructions which trap do
+// not retire, so this may take several calls to execute.
+void time_travel::advance(uint64_t count) {
+  unsigned int stalled = 0;
+  while (this->cpu->get_instruction_count() < count &&
+         !this->cpu->is_halted() && stalled < max_stalled) {
+    uint64_t before = this->cpu->get_instruction_count();
+    this->cpu->execute(std::min<uint64_t>(count - before, 1U << 30), false);
+    stalled = this->cpu->get_instruction_count() == before ? stalled + 1 : 0;
+  }
+}
+
+// Move to the point a number of steps after an instruction count was reached,
+// each step being a call to execute one instruction, which may trap instead
+void time_travel::seek(uint64_t count, uint64_t steps) {
+  size_t index = find_checkpoint(count);
+  if (index != this->current || this->cpu->get_instruction_count() >= count)
+    restore(index);
+  this->replaying = true;
+  advance(count);
+  for (uint64_t i = 0; i < steps; i++)
+    this->cpu->execute(1, false);
+  this->replaying = false;
+}
+
+void time_travel::reverse_step(uint64_t count) {
+  uint64_t present = this->cpu->get_instruction_count();
+  uint64_t start = this->checkpoints.front().instruction_count;
+  leave_end();
+  if (present < start + count) {
+    std::cout << "Start of history reached" << std::endl;
+    seek(start, 0);
+  } else {
+    seek(present - count, 0);
+  }
+}
+
+// Each stretch of history between checkpoints is executed a step at a time,
+// from the latest back, until the breakpoint is found in one
+void time_travel::reverse_continue() {
+  uint64_t breakpoint;
+  if (!this->cpu->get_breakpoint(breakpoint)) {
+    std::cout << "No breakpoint set" << std::endl;
+    return;
+  }
+  uint64_t present = this->cpu->get_instruction_count();
+  leave_end();
+  size_t index = find_checkpoint(present);
+  while (index > 0 && this->checkpoints[index].instruction_count >= present)
+    index--;
+  for (size_t i = index + 1; i-- > 0;) {
+    uint64_t end = present;
+    if (i + 1 < this->checkpoints.size())
+      end = std::min(end, this->checkpoints[i + 1].instruction_count);
+    restore(i);
+    this->replaying = true;
+    bool found = false;
+    uint64_t found_count = 0, found_steps = 0, steps = 0;
+    unsigned int stalled = 0;
+    while (true) {
+      uint64_t count = this->cpu->get_instruction_count();
+      if (count >= end || this->cpu->is_halted() || stalled >= max_stalled)
+        break;
+      if (this->cpu->get_pc() == breakpoint) {
+        found = true;
+        found_count = count;
+        found_steps = steps;
+      }
+      this->cpu->execute(1, false);
+      if (this->cpu->get_instruction_count() == count) {
+        steps++;
+        stalled++;
+      } else {
+        steps = 0;
+        stalled = 0;
+      }
+    }
+    this->replaying = false;
+    if (found) {
+      seek(found_count, found_steps);
+      std::cout << "Breakpoint reached at " << std::setw(16)
+                << std::setfill('0') << std::hex << breakpoint << std::endl;
+      return;
+    }
+  }
+  std::cout << "Start of history reached" << std::endl;
+  seek(this->checkpoints.front().instruction_count, 0);
+}
+
+void time_travel::go_to(uint64_t count) {
+  uint64_t end = this->at_end ? this->cpu->get_instruction_count()
+                              : this->checkpoints.back().instruction_count;
+  if (count > end) {
+    std::cout << "Instruction count beyond history" << std::endl;
+    return;
+  }
+  leave_end();
+  if (count < this->checkpoints.front().instruction_count) {
+    std::cout << "Start of history reached" << std::endl;
+    count = this->checkpoints.front().instruction_count;
+  }
+  seek(count, 0);
+}
@@ -0,0 +1,97 @@
+#ifndef TIME_TRAVEL_H
+#define TIME_TRAVEL_H
+
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class for reverse execution
+
+**************************************************************** */
+
+#include <cstdint>
+#include <vector>
+
+#include "memory.h"
+#include "scheduler.h"
+
+class processor;
+
+// Records the history of execution so that it can be moved back through.
+// Checkpoints of the processor state and the pages written since the previous
+// checkpoint are held in memory, taken at a fixed interval of ticks and after
+// every change made by a command, such as writing a register. Moving to an
+// earlier point restores the nearest checkpoint before it and executes
+// forward, which repeats the original execution exactly, as nothing but
+// instructions changes the machine between checkpoints.
+//
+// Moving back leaves the later history in place, so it can be moved forward
+// through again, until the machine is changed by executing instructions or by
+// a command. Devices other than the CLINT are not restored.
+//
+// Executing forward again would repeat anything done on the host, such as
+// output written by the system call proxy or a proxied exit, so reverse
+// execution cannot be used with the system call proxy or native routines.
+class time_travel {
+
+public:
+  // Constructor
+  time_travel(memory *main_memory, processor *cpu, scheduler *events,
+              uint64_t interval);
+
+  // Call before changing the machine by executing instructions or by a
+  // command. History after the current point is discarded.
+  void begin_change();
+
+  // Call after the change. Changes made by commands are recorded with a
+  // checkpoint, as they can not be repeated by executing forward.
+  void end_change(bool command);
+
+  // Move back a number of instructions
+  void reverse_step(uint64_t count);
+
+  // Move back to the last point at which execution reached the breakpoint
+  void reverse_continue();
+
+  // Move to the point at which an instruction count was reached
+  void go_to(uint64_t count);
+
+private:
+  // We do not have ownership over these objects! Do not free them!
+  memory *main_memory;
+  processor *cpu;
+  scheduler *events;
+
+  struct checkpoint {
+    uint64_t instruction_count;
+    std::vector<uint64_t> state;
+    // Page numbers in order, and contents, of pages written since the
+    // previous checkpoint, or of every stored page for the first
+    std::vector<uint64_t> keys;
+    std::vector<uint8_t> contents;
+  };
+
+  uint64_t interval;
+  std::vector<checkpoint> checkpoints;
+  // The checkpoint the machine was last restored from or saved to, and the
+  // dirty page generation since then
+  size_t current;
+  uint64_t generation;
+  // Whether the machine is at the end of history rather than moved back, and
+  // whether it is executing forward from a checkpoint
+  bool at_end;
+  bool replaying;
+  bool event_scheduled;
+  uint64_t checkpoint_event;
+
+  void schedule_checkpoint();
+  void start_history();
+  void take_checkpoint();
+  void leave_end();
+  void restore(size_t index);
+  size_t find_checkpoint(uint64_t count);
+  void advance(uint64_t count);
+  void seek(uint64_t count, uint64_t steps);
+};
+
+#endif
@@ -0,0 +1,156 @@
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class members for the UART console
+
+**************************************************************** */
+
+#include <fcntl.h>
+#include <iostream>
+#include <unistd.h>
+
+#include "uart.h"
+
+constexpr uint64_t uart::base;
+constexpr uint64_t uart::size;
+
+// Register numbers
+static constexpr unsigned int rbr_thr = 0; // DLL when LCR.DLAB is set
+static constexpr unsigned int ier_register = 1; // DLM when LCR.DLAB is set
+static constexpr unsigned int iir_fcr = 2;
+static constexpr unsigned int lcr_register = 3;
+static constexpr unsigned int mcr_register = 4;
+static constexpr unsigned int lsr_register = 5;
+static constexpr unsigned int msr_register = 6;
+static constexpr unsigned int scr_register = 7;
+
+static constexpr uint8_t lcr_dlab = 0x80;
+static constexpr uint8_t lsr_data_ready = 0x01;
+// The transmitter is always empty, as host output never blocks
+static constexpr uint8_t lsr_transmitter_empty = 0x60;
+
+// Constructor
+uart::uart(std::string rx_file_name, size_t flush_bytes, uint64_t flush_ticks)
+    : flush_bytes(flush_bytes), flush_ticks(flush_ticks), rx_fd(-1),
+      rx_next(-1), ier(0), fcr(0), lcr(0), mcr(0), scr(0), divisor(0) {
+  this->tx_buffer.reserve(flush_bytes);
+  if (!rx_file_name.empty()) {
+    this->rx_fd = open(rx_file_name.c_str(), O_RDONLY | O_NONBLOCK);
+    if (this->rx_fd < 0)
+      std::cout << "Failed to open UART input file" << std::endl;
+  }
+}
+
+uart::~uart() {
+  flush();
+  if (this->rx_fd >= 0)
+    close(this->rx_fd);
+}
+
+// Reading ahead returns at once if a pipe is empty, or has no writer yet, and
+// the byte is looked for again on the next read
+bool uart::rx_ready() {
+  if (this->rx_next < 0 && this->rx_fd >= 0) {
+    uint8_t byte;
+    if (read(this->rx_fd, &byte, 1) == 1)
+      this->rx_next = byte;
+  }
+  return this->rx_next >= 0;
+}
+
+uint8_t uart::read_register(unsigned int number) {
+  bool dlab = this->lcr & lcr_dlab;
+  uint8_t value;
+  switch (number) {
+  case rbr_thr:
+    if (dlab)
+      return this->divisor & 0xff;
+    if (!rx_ready())
+      return 0;
+    value = this->rx_next;
+    this->rx_next = -1;
+    return value;
+  case ier_register:
+    return dlab ? this->divisor >> 8 : this->ier;
+  case iir_fcr:
+    // No interrupt pending, with FIFOs enabled if requested
+    return (this->fcr & 0x01) ? 0xc1 : 0x01;
+  case lcr_register:
+    return this->lcr;
+  case mcr_register:
+    return this->mcr;
+  case lsr_register:
+    return lsr_transmitter_empty | (rx_ready() ? lsr_data_ready : 0);
+  case msr_register:
+    return 0;
+  case scr_register:
+    return this->scr;
+  default:
+    return 0;
+  }
+}
+
+void uart::write_register(unsigned int number, uint8_t value) {
+  bool dlab = this->lcr & lcr_dlab;
+  switch (number) {
+  case rbr_thr:
+    if (dlab) {
+      this->divisor = (this->divisor & 0xff00) | value;
+    } else {
+      this->tx_buffer.push_back(value);
+      if (this->flush_bytes && this->tx_buffer.size() >= this->flush_bytes)
+        flush();
+    }
+    break;
+  case ier_register:
+    if (dlab)
+      this->divisor = (this->divisor & 0x00ff) | (value << 8);
+    else
+      this->ier = value & 0x0f;
+    break;
+  case iir_fcr:
+    this->fcr = value;
+    break;
+  case lcr_register:
+    this->lcr = value;
+    break;
+  case mcr_register:
+    this->mcr = value & 0x1f;
+    break;
+  case scr_register:
+    this->scr = value;
+    break;
+  }
+}
+
+uint64_t uart::read_doubleword(uint64_t offset, uint64_t mask, uint64_t now) {
+  uint64_t data = 0;
+  for (unsigned int i = 0; i < 8; i++) {
+    if ((mask >> (i * 8)) & 0xff)
+      data |= static_cast<uint64_t>(read_register(offset + i)) << (i * 8);
+  }
+  return data;
+}
+
+void uart::write_doubleword(uint64_t offset, uint64_t data, uint64_t mask,
+                            uint64_t now) {
+  for (unsigned int i = 0; i < 8; i++) {
+    if ((mask >> (i * 8)) & 0xff)
+      write_register(offset + i, data >> (i * 8));
+  }
+}
+
+uint64_t uart::tick(uint64_t now) {
+  flush();
+  return this->flush_ticks ? now + this->flush_ticks : never;
+}
+
+// Write buffered output to the host in one call
+void uart::flush() {
+  if (this->tx_buffer.empty())
+    return;
+  std::cout.write(this->tx_buffer.data(), this->tx_buffer.size());
+  std::cout.flush();
+  this->tx_buffer.clear();
+}
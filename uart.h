@@ -0,0 +1,63 @@
+#ifndef UART_H
+#define UART_H
+
+/* ****************************************************************
+   RISC-V Instruction Set Simulator
+   Computer Architecture, Semester 1, 2024
+
+   Class for a 16550-style UART console
+
+**************************************************************** */
+
+#include <cstdint>
+#include <string>
+
+#include "device.h"
+
+// Transmitted bytes are collected in a host buffer, which is written to
+// standard output once it holds flush_bytes bytes, every flush_ticks ticks,
+// and whenever the simulator stops executing. A count of 0 disables that
+// trigger. Received bytes are read from a host file or pipe without waiting,
+// so a guest polling the line status register keeps running while a pipe is
+// empty.
+class uart : public device {
+
+private:
+  std::string tx_buffer;
+  size_t flush_bytes;
+  uint64_t flush_ticks;
+
+  // Nonblocking file descriptor of the input, or -1 if there is none
+  int rx_fd;
+  // Next received byte, or -1 if none has been read from the file yet
+  int rx_next;
+  bool rx_ready();
+
+  uint8_t ier;
+  uint8_t fcr;
+  uint8_t lcr;
+  uint8_t mcr;
+  uint8_t scr;
+  uint16_t divisor;
+
+  uint8_t read_register(unsigned int number);
+  void write_register(unsigned int number, uint8_t value);
+
+public:
+  // Registers are one byte apart from base, as on the QEMU virt machine
+  static constexpr uint64_t base = 0x0000000010000000ULL;
+  static constexpr uint64_t size = 0x0000000000000008ULL;
+
+  // Constructor. An empty rx_file_name leaves the receiver without input.
+  uart(std::string rx_file_name, size_t flush_bytes, uint64_t flush_ticks);
+  ~uart();
+
+  uint64_t read_doubleword(uint64_t offset, uint64_t mask,
+                           uint64_t now) override;
+  void write_doubleword(uint64_t offset, uint64_t data, uint64_t mask,
+                        uint64_t now) override;
+  uint64_t tick(uint64_t now) override;
+  void flush() override;
+};
+
+#endif